@@ -1,21 +1,193 @@
-import socket, struct, datetime, os, time, sys
+import socket, struct, datetime, os, time, sys, random, zlib
 sys.path.append('amy')
 import amy
 from amy import *
 ALLES_LATENCY_MS = 1000
+ALLES_WIDE_CLIENT = 65536 # client=ALLES_WIDE_CLIENT+n addresses client_id n, for meshes past 255 synths
 UDP_PORT = 9294
+ALLES_DSCP = 0 # what connect() marks with unless told otherwise, best effort like any other traffic
+DSCP_VOICE = 46 # EF, the WiFi voice queue
+DSCP_VIDEO = 34 # AF41, the video queue
+dscp_mark = 0
 sock = 0
 
 
 # Buffer messages sent to the synths if you call buffer(). 
 # Calling buffer(0) turns off the buffering
 # flush() sends whatever is in the buffer now, and is called after buffer(0) as well 
-send_buffer = ""
+send_buffer = b""
+buffer_destination = None # where send_buffer is going, see groups()
 buffer_size = 0
 
-def transmit(message, retries=1):
+# Send messages in the compact binary format (see main/wire.h) if you call binary(). 
+# Messages with fields the binary format doesn't carry are still sent as ASCII
+binary_mode = False
+BINARY_MAGIC = 0xA1
+WIRE_FIELDS = {
+    'v':'<h', 'w':'<h', 'p':'<h', 'n':'<h', 'o':'<h', 'G':'<h', 'L':'<h', 'g':'<h', 'i':'<h', 'm':'<h', 'M':'<h',
+    'c':'<i', 'r':'<i',
+    'a':'<f', 'b':'<f', 'd':'<f', 'f':'<f', 'F':'<f', 'I':'<f', 'l':'<f', 'P':'<f', 'Q':'<f', 'R':'<f', 'V':'<f',
+    't':'<q', 's':'<q',
+}
+
+def binary(on=True):
+    global binary_mode
+    binary_mode = on
+
+def encode_binary(m):
+    # Returns the binary encoding of an ASCII message, or None if it can't be expressed in binary
+    import re
+    body = b""
+    for (tag, value) in re.findall(r'([A-Za-z_])([^A-Za-z_]*)', m.rstrip('Z')):
+        fmt = WIRE_FIELDS.get(tag)
+        if fmt is None or value == '':
+            return None
+        try:
+            v = float(value) if fmt == '<f' else int(float(value))
+            body = body + tag.encode('ascii') + struct.pack(fmt, v)
+        except (ValueError, struct.error):
+            return None
+    if(len(body) > 255):
+        return None
+    return bytes([BINARY_MAGIC, len(body)]) + body
+
+# Number every datagram if you call sequence(), so synths can drop the extra copies sent with retries > 1
+# before parsing them, and count how many datagrams never arrived. The session is picked at random so synths
+# can tell this run's numbers from an earlier run's, or from another host program on this machine
+sequence_mode = False
+sequence_number = 0
+sequence_session = random.getrandbits(32)
+destination_sequence = {} # destination -> next number, for datagrams that don't go to everyone
+SEQUENCE_HEADER_LEN = 24 # room for "#<seq>,<session>Z"
+
+def sequence(on=True):
+    global sequence_mode
+    sequence_mode = on
+
+def sequence_header(destination):
+    global sequence_number
+    if(destination == get_multicast_group()):
+        (number, session) = (sequence_number, sequence_session)
+        sequence_number = (sequence_number + 1) % 4294967296
+    else:
+        # Each other destination reaches a different set of synths, so it's numbered on its own, as a session of its own
+        session = sequence_session ^ zlib.crc32(repr(destination).encode('ascii'))
+        number = destination_sequence.get(destination, 0)
+        destination_sequence[destination] = (number + 1) % 4294967296
+    return ("#%d,%dZ" % (number, session)).encode('ascii')
+
+# Send a parity datagram after every fec_group datagrams if you call fec(). Synths can rebuild any one 
+# datagram lost from a group, which costs far less airtime than sending everything with retries.
+# Turns on sequence() as well, as that's how synths know which datagram is missing
+fec_group = 0
+fec_sent = []
+
+def fec(group=4):
+    global fec_group, fec_sent
+    if(group > 8): group = 8 # synths only keep the last 8 datagrams
+    fec_group = group
+    fec_sent = []
+    if(group > 0): sequence(True)
+
+def parity(datagrams, first_seq):
+    # "%<first seq>,<count>,<session>Z", the XOR of the lengths, then the XOR of the datagrams padded to the longest
+    longest = max(len(d) for d in datagrams)
+    xor_length = 0
+    xor_data = bytearray(longest)
+    for d in datagrams:
+        xor_length = xor_length ^ len(d)
+        for (j, b) in enumerate(d):
+            xor_data[j] = xor_data[j] ^ b
+    return ("%%%d,%d,%dZ" % (first_seq, len(datagrams), sequence_session)).encode('ascii') + struct.pack('<H', xor_length) + bytes(xor_data)
+
+# Send messages for one synth, or a small group of them, to a multicast group only they listen on if you 
+# call groups(). Switches and access points that snoop IGMP then keep that traffic away from every other synth.
+# Only a client below the number of synths the last sync() found has a group of its own to go to. Bigger
+# ones go to everyone, and each synth wraps them around its own count, which may have moved on since. So
+# do messages sent before any sync(), or more than ROSTER_FRESH_S after the last one, and groups past client 261.
+# Datagrams to each group are numbered on their own for sequence(), only those to everyone get fec() parity
+group_mode = False
+mesh_alive = 0
+roster_time = 0 # time.time() of the last sync() that heard any synths
+ROSTER_FRESH_S = 20 # the synths' MEMBER_EXPIRE_MS, how long they can take to notice one has gone
+MULTICAST_CLIENT_BASE = 0xE80B0000 # 232.11.x.y, client_id x*256+y
+MULTICAST_GROUP_BASE = 0xE80C0000 # 232.12.0.d, client 255+d
+MULTICAST_GROUP_MAX_DIVISOR = 6
+
+# Send messages for one synth straight to its address instead if you call unicast(). WiFi sends multicast 
+# once at its slowest rate, but unicast at the link's rate, retried until the synth acknowledges it, and
+# no other synth has to hear it. Addresses come from the last sync(), a synth it didn't hear is multicast to.
+# client_ids shift as synths come and go, so each datagram starts with "@<node>Z" for the synth that had the
+# client_id at that sync(), and that synth plays what's in it whatever its client_id is by now
+unicast_mode = False
+client_nodes = {} # client_id -> node ID, at the last sync()
+node_addresses = {} # node ID -> its address
+UNICAST_HEADER_LEN = 12 # room for "@<node>Z"
+
+def groups(on=True):
+    global group_mode
+    flush()
+    group_mode = on
+
+def unicast(on=True):
+    global unicast_mode
+    flush()
+    unicast_mode = on
+
+def get_destination(client=-1):
+    if(not (group_mode or unicast_mode) or client is None or client < 0):
+        return get_multicast_group()
+    if(client >= ALLES_WIDE_CLIENT):
+        client = client - ALLES_WIDE_CLIENT
+    elif(client > 255):
+        divisor = client - 255
+        if(not group_mode or divisor < 2 or divisor > MULTICAST_GROUP_MAX_DIVISOR):
+            return get_multicast_group()
+        return (socket.inet_ntoa(struct.pack('>I', MULTICAST_GROUP_BASE + divisor)), UDP_PORT)
+    if(mesh_alive == 0 or client >= mesh_alive or time.time() - roster_time > ROSTER_FRESH_S):
+        return get_multicast_group()
+    if(unicast_mode and client in client_nodes):
+        # The node rides along with the address, as several synths can share one
+        node = client_nodes[client]
+        return (node_addresses[node], UDP_PORT, node)
+    if(group_mode):
+        return (socket.inet_ntoa(struct.pack('>I', MULTICAST_CLIENT_BASE + client)), UDP_PORT)
+    return get_multicast_group()
+
+# Hand messages to allesd (see liballes/allesd.c) if you call sequencer(), instead of the mesh. It holds each 
+# one until its time comes around and packs what's due together, so you can send with a time as far ahead
+# as you like. allesd numbers and resends datagrams itself (its -q and -r), and sends everything to all synths
+sequencer_mode = False
+ALLESD_PORT = 9295
+
+def sequencer(on=True):
+    global sequencer_mode
+    flush()
+    sequencer_mode = on
+
+def transmit(message, retries=1, destination=None):
+    global fec_sent
+    if isinstance(message, str):
+        message = message.encode('ascii')
+    if(sequencer_mode):
+        get_sock().sendto(message, ('127.0.0.1', ALLESD_PORT))
+        return
+    if destination is None:
+        destination = get_multicast_group()
+    if(sequence_mode):
+        # Every copy gets the same number, that's how they're recognized as copies
+        message = sequence_header(destination) + message
+    if(len(destination) == 3):
+        # Unicast to one synth, see unicast()
+        message = ("@%dZ" % (destination[2])).encode('ascii') + message
+        destination = destination[:2]
     for x in range(retries):
-        get_sock().sendto(message.encode('ascii'), get_multicast_group())
+        get_sock().sendto(message, destination)
+    if(fec_group > 0 and destination == get_multicast_group()):
+        fec_sent.append(message)
+        if(len(fec_sent) == fec_group):
+            get_sock().sendto(parity(fec_sent, sequence_number - fec_group), get_multicast_group())
+            fec_sent = []
 
 def buffer(size=508):
     global buffer_size
@@ -25,20 +197,25 @@ def buffer(size=508):
 
 def flush(retries=1):
     global send_buffer
-    transmit(send_buffer)
-    send_buffer = ""
+    if(len(send_buffer)):
+        transmit(send_buffer, retries=retries, destination=buffer_destination)
+    send_buffer = b""
 
 def send(retries=1, **kwargs):
-    global send_buffer
+    global send_buffer, buffer_destination
     m = message(**kwargs)
+    b = encode_binary(m) if binary_mode else None
+    m = b if b is not None else m.encode('ascii')
+    destination = get_destination(kwargs.get('client', -1))
     if(buffer_size > 0):
-        if(len(send_buffer + m) > buffer_size):
-            transmit(send_buffer, retries=retries)
-            send_buffer = m
-        else:
-            send_buffer = send_buffer + m
+        room = buffer_size - (SEQUENCE_HEADER_LEN if sequence_mode else 0) - (UNICAST_HEADER_LEN if len(destination) == 3 else 0)
+        # Messages to somewhere else go after what's buffered, or they'd be applied out of order
+        if(destination != buffer_destination or len(send_buffer + m) > room):
+            flush(retries=retries)
+            buffer_destination = destination
+        send_buffer = send_buffer + m
     else:
-        transmit(m,retries=retries)
+        transmit(m,retries=retries,destination=destination)
 
 # We override AMY's send function to send out to the mesh instead of locally
 amy.override_send = send
@@ -57,9 +234,17 @@ def get_sock():
 def get_multicast_group():
     return ('232.10.11.12', UDP_PORT)
 
-def connect(local_ip=None):
+def set_dscp(dscp):
+    # Mark what we send so the access point queues it ahead of everyone's best effort traffic
+    try:
+        sock.setsockopt(socket.IPPROTO_IP, socket.IP_TOS, dscp << 2)
+    except (AttributeError, OSError):
+        print("couldn't set DSCP %d, sending best effort" % (dscp))
+
+def connect(local_ip=None, dscp=ALLES_DSCP):
     # Set up the socket for multicast send & receive
-    global sock
+    # dscp marks what we send, e.g. DSCP_VOICE. Off (ALLES_DSCP) unless you ask
+    global sock, dscp_mark
 
     # If not given, find your source IP -- by default your main routable network interface. 
     if(local_ip is None):
@@ -93,6 +278,9 @@ def connect(local_ip=None):
     # And the networks to be a member of (destination and host)
     mreq = socket.inet_aton(get_multicast_group()[0]) + socket.inet_aton(local_ip)
     sock.setsockopt(socket.SOL_IP, socket.IP_ADD_MEMBERSHIP, mreq)
+    dscp_mark = dscp
+    if(dscp):
+        set_dscp(dscp)
     # Don't block to receive -- not necessary and we sometimes drop packets we're waiting for
     sock.setblocking(0)
     print("Connected to %s as local IP for multicast IF" % (local_ip))
@@ -119,69 +307,142 @@ def decode_battery_mask(mask):
     return(state, level)
 
 
-def sync(count=10, delay_ms=100):
-    global sock
+def sync(count=10, delay_ms=100, target_miss=None, mesh_latency_ms=None, compare_dscp=False):
+    global sock, mesh_alive, client_nodes, node_addresses, roster_time
     import re
     # Sends sync packets to all the listeners so they can correct / get the time
+    # target_miss (e.g. 0.01) has each synth size its latency to miss that fraction of messages,
+    # mesh_latency_ms sets every synth to the same fixed latency, see agree_latency()
+    # compare_dscp sends count more syncs, every other one unmarked, and prints the round trip and loss of each kind.
+    # The others are marked as connect() was told to, or DSCP_VOICE if it wasn't. Only what we send changes, replies come back however the synths mark them
     clients = {}
     client_map = {}
+    address_map = {}
     battery_map = {}
+    filtered_map = {}
+    clock_error_map = {}
+    latency_map = {}
+    jitter_map = {}
+    options = ""
+    if target_miss is not None:
+        options = options + "m%d" % (int(target_miss * 1000))
+    if mesh_latency_ms is not None:
+        options = options + "M%d" % (mesh_latency_ms)
     start_time = millis()
     last_sent = 0
     time_sent = {}
     rtt = {}
+    total = count * 2 if compare_dscp else count
+    compare_mark = dscp_mark if dscp_mark else DSCP_VOICE
     i = 0
     while 1:
         tic = millis() - start_time
         if((tic - last_sent) > delay_ms):
+            if(compare_dscp):
+                # Even syncs marked, odd ones not, so both see the same network
+                set_dscp(compare_mark if i % 2 == 0 else 0)
             time_sent[i] = millis()
             #print ("sending %d at %d" % (i, time_sent[i]))
-            output = "s%di%dZ" % (time_sent[i], i)
+            output = "s%di%d%sZ" % (time_sent[i], i, options)
             sock.sendto(output.encode('ascii'), get_multicast_group())
             i = i + 1
             last_sent = tic
         try:
             data, address = sock.recvfrom(1024)
-            data = data.decode('ascii')
             #print("received %s from %s" % (data, address))
-            if(data[0] == '_'):
-                data = data[:-1]
+            # Synths queue what they send and may put several messages in one datagram. Only sync replies (_s) matter here
+            for reply in data.decode('ascii', 'ignore').split('Z'):
+                if(not reply.startswith('_s')):
+                    continue
+                # Replies are letter/number pairs, newer synths may send more fields than older ones
+                fields = dict(re.findall(r'([a-z])(-?\d+)', reply[1:]))
                 try:
-                    [_, client_time, sync_index, client_id, ipv4, battery] = re.split(r'[sicry]',data)
-                except ValueError:
-                    print("What! %s" % (data))
+                    [client_time, sync_index, client_id, node, battery] = [fields[k] for k in "sicry"]
+                except KeyError:
+                    print("What! %s" % (reply))
+                    continue
                 if(int(sync_index) <= i): # skip old ones from a previous run
-                    #print ("recvd at %d:  %s %s %s %s" % (millis(), client_time, sync_index, client_id, ipv4))
+                    #print ("recvd at %d:  %s %s %s %s" % (millis(), client_time, sync_index, client_id, node))
                     # ping sets client index to -1, so make sure this is a sync response 
                     if(int(sync_index) >= 0):
-                        client_map[int(ipv4)] = int(client_id)
-                        battery_map[int(ipv4)] = battery
-                        rtt[int(ipv4)] = rtt.get(int(ipv4), {})
-                        rtt[int(ipv4)][int(sync_index)] = millis()-time_sent[int(sync_index)]
+                        client_map[int(node)] = int(client_id)
+                        address_map[int(node)] = address[0]
+                        battery_map[int(node)] = battery
+                        filtered_map[int(node)] = int(fields.get('f', 0))
+                        clock_error_map[int(node)] = int(fields.get('e', -1))
+                        latency_map[int(node)] = int(fields.get('l', ALLES_LATENCY_MS))
+                        jitter_map[int(node)] = int(fields.get('j', -1))
+                        rtt[int(node)] = rtt.get(int(node), {})
+                        # Synths hold their reply for a slot so they don't all answer at once, d says how long
+                        rtt[int(node)][int(sync_index)] = millis()-time_sent[int(sync_index)]-int(fields.get('d', 0))
         except socket.error:
             pass
 
         # Wait for at least (client latency) to get any straggling UDP packets back 
         delay_period = 1 + (ALLES_LATENCY_MS / delay_ms)
-        if((i-delay_period) > count):
+        if((i-delay_period) > total):
             break
+    if(compare_dscp):
+        set_dscp(dscp_mark)
     # Compute average rtt in ms and reliability (number of rt packets we got)
-    for ipv4 in rtt.keys():
+    for node in rtt.keys():
         hit = 0
         total_rtt_ms = 0
-        for i in range(count):
-            ms = rtt[ipv4].get(i, None)
+        for i in range(total):
+            ms = rtt[node].get(i, None)
             if ms is not None:
                 total_rtt_ms = total_rtt_ms + ms
                 hit = hit + 1
-        clients[client_map[ipv4]] = {}
-        clients[client_map[ipv4]]["reliability"] = float(hit)/float(count)
-        clients[client_map[ipv4]]["avg_rtt"] = float(total_rtt_ms) / float(hit) # todo compute std.dev
-        clients[client_map[ipv4]]["ipv4"] = ipv4
-        clients[client_map[ipv4]]["battery"] = decode_battery_mask(int(battery_map[ipv4]))
+        clients[client_map[node]] = {}
+        clients[client_map[node]]["reliability"] = float(hit)/float(total)
+        clients[client_map[node]]["avg_rtt"] = float(total_rtt_ms) / float(hit) # todo compute std.dev
+        rtts = sorted(rtt[node].values())
+        clients[client_map[node]]["p95_rtt"] = rtts[min(len(rtts) - 1, int(len(rtts) * 0.95))]
+        clients[client_map[node]]["node_id"] = node # a hash of its MAC or address, r in its replies
+        clients[client_map[node]]["ipv4"] = int(address_map[node].split('.')[-1]) # the last octet of its address, as it's always been
+        clients[client_map[node]]["address"] = address_map[node] # all of it, which tells apart synths on different /24s
+        clients[client_map[node]]["battery"] = decode_battery_mask(int(battery_map[node]))
+        clients[client_map[node]]["filtered"] = filtered_map[node] # messages it dropped as addressed to others
+        clients[client_map[node]]["clock_error_ms"] = clock_error_map[node] # how sure it is of its clock, -1 if unknown
+        clients[client_map[node]]["latency_ms"] = latency_map[node] # the latency it's playing with
+        clients[client_map[node]]["jitter_ms"] = jitter_map[node] # 95th percentile of how late syncs reach it, -1 if unknown
+        if(compare_dscp):
+            clients[client_map[node]]["dscp"] = {}
+            for (kind, first) in (("marked", 0), ("unmarked", 1)):
+                got = [rtt[node][j] for j in range(first, total, 2) if j in rtt[node]]
+                clients[client_map[node]]["dscp"][kind] = {
+                    "reliability": float(len(got)) / float(count),
+                    "avg_rtt": float(sum(got)) / float(len(got)) if len(got) else None }
+            print("client %d: DSCP %d %s, best effort %s" % (client_map[node], compare_mark,
+                clients[client_map[node]]["dscp"]["marked"], clients[client_map[node]]["dscp"]["unmarked"]))
+    # groups() and unicast() only give a client below this a destination of its own, see get_destination()
+    if(len(clients)):
+        mesh_alive = len(clients)
+        roster_time = time.time()
+        client_nodes = dict([(c, clients[c]["node_id"]) for c in clients])
+        node_addresses = dict([(clients[c]["node_id"], clients[c]["address"]) for c in clients])
     # Return this as a map for future use
     return clients
 
+def agree_latency(target_miss=0.01, count=10, tries=5):
+    # Have every synth measure the latency it needs for target_miss, then put them all on the largest
+    # Returns the latency, or None if some synth still hasn't taken it after tries rounds
+    clients = sync(count=count, target_miss=target_miss)
+    if len(clients) == 0:
+        return None
+    latency_ms = max([c["latency_ms"] for c in clients.values()])
+    waiting = set([c["node_id"] for c in clients.values()])
+    for attempt in range(tries):
+        # The setting rides on syncs, which can be lost like any other datagram. Every reply says what
+        # latency that synth is playing with now, so keep sending until they've all said this one
+        for c in sync(count=3, mesh_latency_ms=latency_ms).values():
+            if(c["latency_ms"] == latency_ms):
+                waiting.discard(c["node_id"])
+        if len(waiting) == 0:
+            return latency_ms
+    print("synths %s didn't take a latency of %d ms" % (sorted(waiting), latency_ms))
+    return None
+
 
 
 def battery_test():
@@ -0,0 +1,110 @@
+# alles_native.py
+# A thin ctypes binding over liballes (see liballes.h), for scripts that send more events a second than
+# alles.py's string building keeps up with. Build the library first with make in this directory.
+#
+#   import alles_native
+#   mesh = alles_native.Host()
+#   now = alles_native.millis()
+#   for i in range(16):
+#       mesh.send(t=now + i * 125, v=0, w=1, n=60 + i, l=1.0)
+#   mesh.flush()
+
+import ctypes, os, sys
+
+_path = os.path.join(os.path.dirname(os.path.abspath(__file__)), "liballes.dylib" if sys.platform == "darwin" else "liballes.so")
+_lib = ctypes.CDLL(_path)
+
+class Synth(ctypes.Structure):
+    _fields_ = [
+        ("node", ctypes.c_uint32),
+        ("client_id", ctypes.c_int32),
+        ("ipv4", ctypes.c_uint32),
+        ("battery", ctypes.c_uint8),
+        ("filtered", ctypes.c_int32),
+        ("clock_error_ms", ctypes.c_int32),
+        ("latency_ms", ctypes.c_int32),
+        ("jitter_ms", ctypes.c_int32),
+        ("reliability", ctypes.c_float),
+        ("avg_rtt_ms", ctypes.c_float),
+        ("p95_rtt_ms", ctypes.c_int32),
+    ]
+
+_lib.alles_open.restype = ctypes.c_void_p
+_lib.alles_open.argtypes = [ctypes.c_char_p]
+_lib.alles_close.argtypes = [ctypes.c_void_p]
+_lib.alles_millis.restype = ctypes.c_int64
+_lib.alles_set_binary.argtypes = [ctypes.c_void_p, ctypes.c_uint8]
+_lib.alles_set_sequence.argtypes = [ctypes.c_void_p, ctypes.c_uint8]
+_lib.alles_set_retries.argtypes = [ctypes.c_void_p, ctypes.c_uint8]
+_lib.alles_set_datagram_len.argtypes = [ctypes.c_void_p, ctypes.c_uint16]
+_lib.alles_set_dscp.argtypes = [ctypes.c_void_p, ctypes.c_uint8]
+_lib.alles_begin.argtypes = [ctypes.c_void_p]
+_lib.alles_i.argtypes = [ctypes.c_void_p, ctypes.c_char, ctypes.c_int64]
+_lib.alles_f.argtypes = [ctypes.c_void_p, ctypes.c_char, ctypes.c_float]
+_lib.alles_end.argtypes = [ctypes.c_void_p]
+_lib.alles_send.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+_lib.alles_flush.argtypes = [ctypes.c_void_p]
+_lib.alles_sync.argtypes = [ctypes.c_void_p, ctypes.c_uint8, ctypes.c_uint16, ctypes.c_int16, ctypes.c_int16,
+    ctypes.POINTER(Synth), ctypes.c_uint16]
+
+MAX_SYNTHS = 4096 # the most a desktop synth tracks
+
+def millis():
+    # The host clock liballes stamps syncs with, use it for t
+    return _lib.alles_millis()
+
+class Host:
+    def __init__(self, local_ip=None, binary=True, sequence=False, retries=1):
+        self.h = _lib.alles_open(local_ip.encode('ascii') if local_ip else None)
+        if not self.h:
+            raise OSError("couldn't join the alles mesh")
+        _lib.alles_set_binary(self.h, binary)
+        _lib.alles_set_sequence(self.h, sequence)
+        _lib.alles_set_retries(self.h, retries)
+
+    def close(self):
+        if self.h:
+            _lib.alles_close(self.h)
+            self.h = None
+
+    def datagram_len(self, length):
+        _lib.alles_set_datagram_len(self.h, length)
+
+    def dscp(self, dscp):
+        # 46 puts what we send in the WiFi voice queue, 34 video, 0 best effort (the default)
+        _lib.alles_set_dscp(self.h, dscp)
+
+    def send(self, **fields):
+        # Fields by their one letter protocol name, v=0 f=440.0 and so on. Floats go as floats, the rest as ints
+        _lib.alles_begin(self.h)
+        for (tag, value) in fields.items():
+            if isinstance(value, float):
+                _lib.alles_f(self.h, tag.encode('ascii'), value)
+            else:
+                _lib.alles_i(self.h, tag.encode('ascii'), int(value))
+        return _lib.alles_end(self.h)
+
+    def message(self, m):
+        # A whole ASCII message, for fields send() can't express (like B's breakpoint lists)
+        return _lib.alles_send(self.h, m.encode('ascii'))
+
+    def flush(self):
+        return _lib.alles_flush(self.h)
+
+    def sync(self, count=10, delay_ms=100, target_miss=None, mesh_latency_ms=None):
+        # The same map as alles.sync(), keyed by client_id
+        synths = (Synth * MAX_SYNTHS)()
+        found = _lib.alles_sync(self.h, count, delay_ms,
+            -1 if target_miss is None else int(target_miss * 1000), -1 if mesh_latency_ms is None else mesh_latency_ms,
+            synths, MAX_SYNTHS)
+        clients = {}
+        for s in synths[:max(found, 0)]:
+            clients[s.client_id] = {
+                "reliability": s.reliability, "avg_rtt": s.avg_rtt_ms, "p95_rtt": s.p95_rtt_ms, "node_id": s.node,
+                "ipv4": "%d.%d.%d.%d" % tuple(s.ipv4.to_bytes(4, 'little')), "battery_mask": s.battery,
+                "filtered": s.filtered, "clock_error_ms": s.clock_error_ms, "latency_ms": s.latency_ms, "jitter_ms": s.jitter_ms,
+            }
+        return clients
+
+    def __del__(self):
+        self.close()
@@ -0,0 +1,244 @@
+// allesd.c
+// A sequencer daemon for the mesh, built on liballes. Clients send it messages through a local UDP socket
+// (ALLESD_PORT), each with its t as they'd send it to the mesh, as far ahead as they like. It keeps them
+// in a heap ordered by t and sends each one when its t comes around, a latency before the mesh plays it,
+// just as a client sending it directly at that moment would. Everything due within the same
+// ALLESD_BATCH_MS goes out together, packed into as few datagrams as it fits in. Messages with no t,
+// or a t that's already gone, go straight away.
+//
+// So a client can queue a whole piece ahead, without sleeping to send things on time and without its
+// far future t re-basing the synths' clocks (see README, Timing & latency).
+
+#include "liballes.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#define ALLESD_PORT 9295          // where clients send, on localhost
+#define ALLESD_BATCH_MS 5         // messages due this soon after the next one go out with it
+#define ALLESD_MAX_EVENTS (1 << 20) // most messages waiting at once
+#define ALLESD_STATS_MS 10000     // how often -g prints stats
+
+typedef struct {
+    int64_t time;          // host ms to send at, from t, 0 for at once
+    uint64_t order;        // arrival, so messages with the same t keep the order they came in
+    uint16_t length;
+    char *data;            // the message as it came in, with a Z if it's ASCII
+} event_t;
+
+static event_t *heap = NULL;
+static uint32_t heap_count = 0;
+static uint32_t heap_size = 0;
+static uint64_t arrivals = 0;
+static uint32_t events_dropped = 0;
+static uint32_t events_released = 0;
+
+static inline uint8_t event_before(event_t *a, event_t *b) {
+    return a->time < b->time || (a->time == b->time && a->order < b->order);
+}
+
+static void heap_push(event_t e) {
+    if(heap_count == heap_size) {
+        uint32_t size = heap_size ? heap_size * 2 : 1024;
+        event_t *grown = (size <= ALLESD_MAX_EVENTS) ? realloc(heap, size * sizeof(event_t)) : NULL;
+        if(grown == NULL) {
+            events_dropped++;
+            free(e.data);
+            return;
+        }
+        heap = grown;
+        heap_size = size;
+    }
+    uint32_t i = heap_count++;
+    while(i > 0 && event_before(&e, &heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = e;
+}
+
+static event_t heap_pop() {
+    event_t top = heap[0];
+    event_t last = heap[--heap_count];
+    uint32_t i = 0;
+    while(1) {
+        uint32_t child = i * 2 + 1;
+        if(child >= heap_count) break;
+        if(child + 1 < heap_count && event_before(&heap[child + 1], &heap[child])) child++;
+        if(!event_before(&heap[child], &last)) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    if(heap_count) heap[i] = last;
+    return top;
+}
+
+// The t of one ASCII or binary message, or 0 if it has none
+static int64_t message_time(const char *message, uint16_t length) {
+    if((uint8_t)message[0] == ALLES_BINARY_MAGIC) {
+        const uint8_t *m = (const uint8_t *)message;
+        for(uint16_t c=2;c<length;) {
+            uint8_t kind = wire_kind(m[c]);
+            if(kind == WIRE_NONE || c + 1 + wire_widths[kind] > length) return 0;
+            if(m[c] == 't') return wire_get_i64(m + c + 1);
+            c += 1 + wire_widths[kind];
+        }
+        return 0;
+    }
+    for(uint16_t c=0;c+1<length;c++) {
+        if(message[c] == 't') return strtoll(message + c + 1, NULL, 10);
+    }
+    return 0;
+}
+
+// Split a datagram from a client into messages and queue each one
+static void queue_datagram(char *data, uint16_t length) {
+    uint16_t start = 0;
+    while(start < length) {
+        uint16_t end;
+        if((uint8_t)data[start] == ALLES_BINARY_MAGIC) {
+            if(start + 2 > length || start + 2 + (uint8_t)data[start + 1] > length) return;
+            end = start + 2 + (uint8_t)data[start + 1];
+        } else {
+            char *z = memchr(data + start, 'Z', length - start);
+            end = z ? (z - data) + 1 : length;
+        }
+        uint16_t message_length = end - start;
+        // A client that leaves off the last Z still means one
+        uint8_t add_z = ((uint8_t)data[start] != ALLES_BINARY_MAGIC && data[end - 1] != 'Z');
+        // A lone Z is an empty message
+        if(message_length > 1 || data[start] != 'Z') {
+            event_t e;
+            e.length = message_length + add_z;
+            e.data = malloc(e.length);
+            if(e.data == NULL) {
+                events_dropped++;
+                return;
+            }
+            memcpy(e.data, data + start, message_length);
+            if(add_z) e.data[message_length] = 'Z';
+            e.time = message_time(e.data, e.length);
+            e.order = arrivals++;
+            heap_push(e);
+        }
+        start = end;
+    }
+}
+
+// Send everything due by horizon, packed into as few datagrams as it fits
+static void release(alles_host_t *h, int64_t horizon) {
+    uint32_t released = 0;
+    while(heap_count && heap[0].time <= horizon) {
+        event_t e = heap_pop();
+        alles_queue(h, e.data, e.length);
+        free(e.data);
+        released++;
+    }
+    if(released) {
+        alles_flush(h);
+        events_released += released;
+    }
+}
+
+int main(int argc, char **argv) {
+    char *local_ip = NULL;
+    uint16_t port = ALLESD_PORT;
+    int64_t batch_ms = ALLESD_BATCH_MS;
+    uint8_t debug_on = 0;
+    uint8_t sequence = 0;
+    uint8_t retries = 1;
+    uint16_t datagram_len = LIBALLES_DATAGRAM_LEN;
+    uint8_t dscp = ALLES_DSCP;
+    int opt;
+    while((opt = getopt(argc, argv, ":i:p:w:s:r:t:qgh")) != -1) {
+        switch(opt) {
+            case 'i':
+                local_ip = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'w':
+                batch_ms = atoi(optarg);
+                break;
+            case 's':
+                datagram_len = atoi(optarg);
+                break;
+            case 'r':
+                retries = atoi(optarg);
+                break;
+            case 't':
+                dscp = atoi(optarg);
+                break;
+            case 'q':
+                sequence = 1;
+                break;
+            case 'g':
+                debug_on = 1;
+                break;
+            case 'h':
+                printf("usage: allesd\n\t[-i multicast interface ip address, default, autodetect]\n");
+                printf("\t[-p local port clients send to, default %d]\n", ALLESD_PORT);
+                printf("\t[-w ms of messages sent together, default %d]\n", ALLESD_BATCH_MS);
+                printf("\t[-s datagram size, default %d]\n", LIBALLES_DATAGRAM_LEN);
+                printf("\t[-r send every datagram this many times, default 1]\n");
+                printf("\t[-t DSCP to mark datagrams with, 46 is WMM voice, 34 video, 0 best effort, default %d]\n", ALLES_DSCP);
+                printf("\t[-q number datagrams so synths drop the copies -r makes]\n");
+                printf("\t[-g print stats every %d seconds]\n", ALLESD_STATS_MS / 1000);
+                printf("\t[-h show this help and exit]\n");
+                return 0;
+            case ':':
+                printf("option needs a value\n");
+                break;
+            case '?':
+                printf("unknown option: %c\n", optopt);
+                break;
+        }
+    }
+
+    alles_host_t *h = alles_open(local_ip);
+    if(h == NULL) return 1;
+    alles_set_datagram_len(h, datagram_len);
+    alles_set_sequence(h, sequence);
+    alles_set_retries(h, retries);
+    alles_set_dscp(h, dscp);
+
+    int in = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in saddr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(in < 0 || bind(in, (struct sockaddr *)&saddr, sizeof(saddr)) < 0) {
+        fprintf(stderr, "failed to bind 127.0.0.1:%d. Error %d\n", port, errno);
+        return 1;
+    }
+    fcntl(in, F_SETFL, fcntl(in, F_GETFL, 0) | O_NONBLOCK);
+    printf("allesd listening on 127.0.0.1:%d\n", port);
+
+    char data[LIBALLES_MAX_DATAGRAM];
+    int64_t next_stats = alles_millis() + ALLESD_STATS_MS;
+    while(1) {
+        int64_t now = alles_millis();
+        // Once the first message is due, everything within batch_ms after it goes with it
+        if(heap_count && heap[0].time - batch_ms <= now) release(h, (heap[0].time > now ? heap[0].time : now) + batch_ms);
+        if(debug_on && now >= next_stats) {
+            printf("allesd: %" PRIu32 " waiting, %" PRIu32 " sent in %" PRIu32 " datagrams, %" PRIu32 " dropped\n",
+                heap_count, events_released, h->datagrams, events_dropped);
+            next_stats = now + ALLESD_STATS_MS;
+        }
+        // Sleep until the next message is due, or more come in
+        int64_t wait_ms = next_stats - now;
+        if(heap_count && heap[0].time - batch_ms - now < wait_ms) wait_ms = heap[0].time - batch_ms - now;
+        if(wait_ms < 0) wait_ms = 0;
+        struct pollfd p = { .fd = in, .events = POLLIN };
+        if(poll(&p, 1, (debug_on || heap_count) ? wait_ms : -1) <= 0) continue;
+        ssize_t length;
+        while((length = recv(in, data, sizeof(data), 0)) > 0) queue_datagram(data, length);
+    }
+    return 0;
+}
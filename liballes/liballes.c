@@ -0,0 +1,400 @@
+// liballes.c
+// See liballes.h. Messages are built straight into the datagram they'll go out in: ASCII as in alles.py,
+// or the binary format from wire.h when binary is on and every field fits it, mixed freely in a datagram.
+
+#include "liballes.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+// The same clock as millis() in alles.py (from amy.py): UTC now less the start of today's local date, as if
+// it were UTC. Odd, but it means liballes, allesd and alles.py can all drive one mesh without re-basing it
+int64_t alles_millis() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    time_t now = ts.tv_sec;
+    struct tm local;
+    localtime_r(&now, &local);
+    struct tm midnight = { .tm_year = local.tm_year, .tm_mon = local.tm_mon, .tm_mday = local.tm_mday };
+    return (ts.tv_sec - timegm(&midnight)) * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// The address of the interface that routes off this machine. No packet is sent, connect just picks a route
+static int routable_address(struct in_addr *addr) {
+    struct sockaddr_in probe = { .sin_family = AF_INET, .sin_port = htons(1) };
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+    int s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(s < 0) return -1;
+    inet_pton(AF_INET, "10.255.255.255", &probe.sin_addr);
+    int err = connect(s, (struct sockaddr *)&probe, sizeof(probe));
+    if(err == 0) err = getsockname(s, (struct sockaddr *)&local, &len);
+    close(s);
+    if(err < 0) return -1;
+    *addr = local.sin_addr;
+    return 0;
+}
+
+// A random session number for the sequence header, from the kernel if it'll give us one
+static uint32_t session_id() {
+    uint32_t id = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
+    if(fd >= 0) {
+        if(read(fd, &id, sizeof(id)) != sizeof(id)) id = 0;
+        close(fd);
+    }
+    if(id == 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        id = (uint32_t)now.tv_sec ^ (uint32_t)now.tv_nsec ^ ((uint32_t)getpid() << 16);
+    }
+    return id;
+}
+
+alles_host_t *alles_open(const char *local_ip) {
+    struct in_addr iaddr;
+    if(local_ip != NULL) {
+        if(inet_pton(AF_INET, local_ip, &iaddr) != 1) {
+            fprintf(stderr, "liballes: %s is not an IPv4 address\n", local_ip);
+            return NULL;
+        }
+    } else if(routable_address(&iaddr) < 0) {
+        fprintf(stderr, "liballes: trouble getting a routable IP address, using localhost\n");
+        inet_pton(AF_INET, "127.0.0.1", &iaddr);
+    }
+
+    alles_host_t *h = calloc(1, sizeof(alles_host_t));
+    if(h == NULL) return NULL;
+    h->datagram_len = LIBALLES_DATAGRAM_LEN;
+    h->retries = 1;
+    h->sequence_session = session_id();
+    h->group.sin_family = AF_INET;
+    h->group.sin_port = htons(UDP_PORT);
+    inet_pton(AF_INET, MULTICAST_IPV4_ADDR, &h->group.sin_addr);
+
+    h->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(h->sock < 0) {
+        fprintf(stderr, "liballes: failed to create socket. Error %d\n", errno);
+        free(h);
+        return NULL;
+    }
+    // Same setup as alles.py's connect(), so both can run on one machine alongside a desktop synth
+    int yes = 1;
+    setsockopt(h->sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+#ifdef SO_REUSEPORT
+    setsockopt(h->sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
+#endif
+    struct sockaddr_in saddr = { .sin_family = AF_INET, .sin_port = htons(UDP_PORT), .sin_addr.s_addr = htonl(INADDR_ANY) };
+    uint8_t ttl = 255;
+    uint8_t loopback = 1;
+    struct ip_mreq imreq = { .imr_multiaddr = h->group.sin_addr, .imr_interface = iaddr };
+    if(bind(h->sock, (struct sockaddr *)&saddr, sizeof(saddr)) < 0 ||
+       setsockopt(h->sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+       setsockopt(h->sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loopback, sizeof(loopback)) < 0 ||
+       setsockopt(h->sock, IPPROTO_IP, IP_MULTICAST_IF, &iaddr, sizeof(iaddr)) < 0 ||
+       setsockopt(h->sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &imreq, sizeof(imreq)) < 0) {
+        fprintf(stderr, "liballes: failed to set up the multicast socket. Error %d\n", errno);
+        close(h->sock);
+        free(h);
+        return NULL;
+    }
+    fcntl(h->sock, F_SETFL, fcntl(h->sock, F_GETFL, 0) | O_NONBLOCK);
+    alles_set_dscp(h, ALLES_DSCP);
+    return h;
+}
+
+void alles_close(alles_host_t *h) {
+    if(h == NULL) return;
+    alles_flush(h);
+    close(h->sock);
+    free(h);
+}
+
+void alles_set_binary(alles_host_t *h, uint8_t on) { h->binary = on; }
+void alles_set_sequence(alles_host_t *h, uint8_t on) { alles_flush(h); h->sequence = on; }
+void alles_set_retries(alles_host_t *h, uint8_t retries) { h->retries = retries ? retries : 1; }
+
+// Mark what we send with this DSCP so WiFi queues it ahead of best effort traffic, see ALLES_DSCP
+int alles_set_dscp(alles_host_t *h, uint8_t dscp) {
+    int tos = dscp << 2;
+    if(setsockopt(h->sock, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0) {
+        fprintf(stderr, "liballes: failed to set DSCP %d. Error %d\n", dscp, errno);
+        return -1;
+    }
+    return 0;
+}
+
+void alles_set_datagram_len(alles_host_t *h, uint16_t length) {
+    alles_flush(h);
+    if(length < LIBALLES_SEQUENCE_HEADER_LEN + 1) length = LIBALLES_SEQUENCE_HEADER_LEN + 1;
+    if(length > LIBALLES_MAX_DATAGRAM) length = LIBALLES_MAX_DATAGRAM;
+    h->datagram_len = length;
+}
+
+int alles_flush(alles_host_t *h) {
+    int err = 0;
+    if(h->length == 0) return 0;
+    for(uint8_t r=0;r<h->retries;r++) {
+        if(sendto(h->sock, h->datagram, h->length, 0, (struct sockaddr *)&h->group, sizeof(h->group)) < 0) {
+            fprintf(stderr, "liballes: sendto failed. Error %d\n", errno);
+            err = -1;
+        }
+    }
+    h->datagrams++;
+    h->length = 0;
+    return err;
+}
+
+// Add a finished message to the datagram, sending the datagram first if the message won't fit.
+// A message bigger than datagram_len on its own still goes, in a datagram by itself
+int alles_queue(alles_host_t *h, const void *message, uint16_t length) {
+    int err = 0;
+    if(length > LIBALLES_MAX_DATAGRAM - LIBALLES_SEQUENCE_HEADER_LEN) {
+        fprintf(stderr, "liballes: message too long\n");
+        return -1;
+    }
+    if(h->length && h->length + length > h->datagram_len) err = alles_flush(h);
+    if(h->length == 0 && h->sequence) {
+        // Every copy retries sends has the same number, which is how synths know to drop them
+        h->length = sprintf(h->datagram, "#%" PRIu32 ",%" PRIu32 "Z", h->sequence_number, h->sequence_session);
+        h->sequence_number++;
+    }
+    memcpy(h->datagram + h->length, message, length);
+    h->length += length;
+    h->messages++;
+    return err;
+}
+
+void alles_begin(alles_host_t *h) {
+    h->text_length = 0;
+    h->body_length = 0;
+    h->body_ok = h->binary;
+}
+
+static void text_field(alles_host_t *h, const char *field, int length) {
+    // Room for the Z. A message that overflows is marked too long for alles_end to refuse
+    if(h->text_length + length + 1 > LIBALLES_MESSAGE_LEN) {
+        h->text_length = LIBALLES_MESSAGE_LEN;
+        return;
+    }
+    memcpy(h->text + h->text_length, field, length);
+    h->text_length += length;
+}
+
+// Append tag and value to the binary body, if the tag has a binary form and there's room
+static void body_field(alles_host_t *h, char tag, int64_t i, float f) {
+    uint8_t kind = wire_kind(tag);
+    if(!h->body_ok || kind == WIRE_NONE || h->body_length + 1 + wire_widths[kind] > WIRE_MAX_BODY) {
+        h->body_ok = 0;
+        return;
+    }
+    uint8_t *p = h->body + h->body_length;
+    *p++ = tag;
+    // Little-endian on the wire like the hosts we build for, see wire.h
+    if(kind == WIRE_I16) {
+        if(i < INT16_MIN || i > INT16_MAX) { h->body_ok = 0; return; }
+        int16_t v = i; memcpy(p, &v, 2);
+    } else if(kind == WIRE_I32) {
+        if(i < INT32_MIN || i > INT32_MAX) { h->body_ok = 0; return; }
+        int32_t v = i; memcpy(p, &v, 4);
+    } else if(kind == WIRE_F32) {
+        memcpy(p, &f, 4);
+    } else {
+        memcpy(p, &i, 8);
+    }
+    h->body_length += 1 + wire_widths[kind];
+}
+
+void alles_i(alles_host_t *h, char tag, int64_t value) {
+    char field[24];
+    text_field(h, field, snprintf(field, sizeof(field), "%c%" PRId64, tag, value));
+    body_field(h, tag, value, (float)value);
+}
+
+void alles_f(alles_host_t *h, char tag, float value) {
+    // No exponents, synths split fields on letters. Trailing zeros are just bytes on the air
+    char field[64];
+    int length = snprintf(field, sizeof(field), "%c%f", tag, value);
+    while(length > 2 && field[length-1] == '0') length--;
+    if(field[length-1] == '.') length--;
+    text_field(h, field, length);
+    body_field(h, tag, (int64_t)value, value);
+}
+
+int alles_end(alles_host_t *h) {
+    if(h->text_length == LIBALLES_MESSAGE_LEN) {
+        fprintf(stderr, "liballes: message too long\n");
+        return -1;
+    }
+    if(h->text_length == 0) return 0;
+    if(h->body_ok) {
+        uint8_t message[2 + WIRE_MAX_BODY];
+        message[0] = ALLES_BINARY_MAGIC;
+        message[1] = h->body_length;
+        memcpy(message + 2, h->body, h->body_length);
+        return alles_queue(h, message, 2 + h->body_length);
+    }
+    h->text[h->text_length] = 'Z';
+    return alles_queue(h, h->text, h->text_length + 1);
+}
+
+int alles_send(alles_host_t *h, const char *message) {
+    size_t length = strlen(message);
+    if(length == 0) return 0;
+    if(length + 1 > LIBALLES_MESSAGE_LEN) {
+        fprintf(stderr, "liballes: message too long\n");
+        return -1;
+    }
+    if(message[length-1] == 'Z') return alles_queue(h, message, length);
+    memcpy(h->text, message, length);
+    h->text[length] = 'Z';
+    return alles_queue(h, h->text, length + 1);
+}
+
+// A synth's replies to one alles_sync
+typedef struct {
+    alles_synth_t synth;
+    int32_t rtts[LIBALLES_MAX_SYNCS]; // -1 until it answers that sync
+} roster_entry_t;
+
+// Pull the letter/number pairs out of a sync reply like _s65201i4c248r12y2, into fields by letter.
+// Returns a bit per letter found
+static uint32_t reply_fields(const char *reply, int64_t *fields) {
+    uint32_t found = 0;
+    const char *p = reply;
+    while(*p) {
+        char *end;
+        if(*p >= 'a' && *p <= 'z') {
+            int64_t v = strtoll(p + 1, &end, 10);
+            if(end != p + 1) {
+                fields[*p - 'a'] = v;
+                found |= 1UL << (*p - 'a');
+                p = end;
+                continue;
+            }
+        }
+        p++;
+    }
+    return found;
+}
+
+#define REPLY_HAS(found, c) ((found) & (1UL << ((c) - 'a')))
+
+static void sync_reply(const char *reply, uint32_t address, int64_t arrived, int64_t *sent, uint8_t sent_count,
+    roster_entry_t *roster, uint16_t *found, uint16_t max_synths) {
+    int64_t fields[26];
+    uint32_t has = reply_fields(reply, fields);
+    if(!REPLY_HAS(has, 's') || !REPLY_HAS(has, 'i') || !REPLY_HAS(has, 'c') || !REPLY_HAS(has, 'r') || !REPLY_HAS(has, 'y')) return;
+    // Pings have i -1, and anything past what we've sent is from someone else's sync
+    int64_t index = fields['i' - 'a'];
+    if(index < 0 || index >= sent_count) return;
+    uint32_t node = fields['r' - 'a'];
+    roster_entry_t *e = NULL;
+    for(uint16_t i=0;i<*found;i++) if(roster[i].synth.node == node) e = &roster[i];
+    if(e == NULL) {
+        if(*found == max_synths) return;
+        e = &roster[(*found)++];
+        e->synth.node = node;
+        for(uint8_t i=0;i<LIBALLES_MAX_SYNCS;i++) e->rtts[i] = -1;
+    }
+    e->synth.client_id = fields['c' - 'a'];
+    e->synth.ipv4 = address;
+    e->synth.battery = fields['y' - 'a'];
+    e->synth.filtered = REPLY_HAS(has, 'f') ? fields['f' - 'a'] : 0;
+    e->synth.clock_error_ms = REPLY_HAS(has, 'e') ? fields['e' - 'a'] : -1;
+    e->synth.latency_ms = REPLY_HAS(has, 'l') ? fields['l' - 'a'] : LIBALLES_LATENCY_MS;
+    e->synth.jitter_ms = REPLY_HAS(has, 'j') ? fields['j' - 'a'] : -1;
+    // Synths hold their reply for a slot so they don't all answer at once, d says how long
+    if(e->rtts[index] < 0) {
+        int64_t rtt = arrived - sent[index] - (REPLY_HAS(has, 'd') ? fields['d' - 'a'] : 0);
+        e->rtts[index] = (rtt > 0) ? rtt : 0;
+    }
+}
+
+static int compare_rtt(const void *a, const void *b) {
+    return *(const int32_t *)a - *(const int32_t *)b;
+}
+
+static int compare_client_id(const void *a, const void *b) {
+    return ((const roster_entry_t *)a)->synth.client_id - ((const roster_entry_t *)b)->synth.client_id;
+}
+
+int alles_sync(alles_host_t *h, uint8_t count, uint16_t delay_ms, int16_t target_miss_permille, int16_t mesh_latency_ms,
+    alles_synth_t *synths, uint16_t max_synths) {
+    if(count > LIBALLES_MAX_SYNCS) count = LIBALLES_MAX_SYNCS;
+    if(count == 0 || max_synths == 0) return 0;
+    roster_entry_t *roster = calloc(max_synths, sizeof(roster_entry_t));
+    if(roster == NULL) return -1;
+    // Anything already queued goes first, syncs shouldn't overtake it
+    alles_flush(h);
+    uint16_t found = 0;
+    int64_t sent[LIBALLES_MAX_SYNCS];
+    uint8_t next = 0;
+    int64_t start = alles_millis();
+    // After the last sync, wait a latency for the stragglers
+    int64_t end = start + (int64_t)(count - 1) * delay_ms + LIBALLES_LATENCY_MS;
+    char data[LIBALLES_MAX_DATAGRAM + 1];
+    while(1) {
+        int64_t now = alles_millis();
+        if(next < count && now >= start + (int64_t)next * delay_ms) {
+            char message[64];
+            int length = sprintf(message, "s%" PRId64 "i%d", now, next);
+            if(target_miss_permille >= 0) length += sprintf(message + length, "m%d", target_miss_permille);
+            if(mesh_latency_ms >= 0) length += sprintf(message + length, "M%d", mesh_latency_ms);
+            message[length++] = 'Z';
+            sent[next++] = now;
+            if(sendto(h->sock, message, length, 0, (struct sockaddr *)&h->group, sizeof(h->group)) < 0) {
+                fprintf(stderr, "liballes: sendto failed. Error %d\n", errno);
+            }
+            continue;
+        }
+        if(now >= end) break;
+        int64_t wake = (next < count) ? start + (int64_t)next * delay_ms : end;
+        struct pollfd p = { .fd = h->sock, .events = POLLIN };
+        if(poll(&p, 1, wake - now) <= 0) continue;
+        struct sockaddr_in from;
+        socklen_t from_length = sizeof(from);
+        ssize_t length;
+        while((length = recvfrom(h->sock, data, LIBALLES_MAX_DATAGRAM, 0, (struct sockaddr *)&from, &from_length)) > 0) {
+            int64_t arrived = alles_millis();
+            data[length] = 0;
+            // Synths may put several messages in one datagram. Only sync replies (_s) matter here
+            for(char *reply = data; reply < data + length; ) {
+                char *z = memchr(reply, 'Z', data + length - reply);
+                if(z) *z = 0;
+                if(reply[0] == '_' && reply[1] == 's') {
+                    sync_reply(reply + 1, from.sin_addr.s_addr, arrived, sent, next, roster, &found, max_synths);
+                }
+                reply = z ? z + 1 : data + length;
+            }
+            from_length = sizeof(from);
+        }
+    }
+
+    qsort(roster, found, sizeof(roster_entry_t), compare_client_id);
+    for(uint16_t i=0;i<found;i++) {
+        int32_t rtts[LIBALLES_MAX_SYNCS];
+        uint8_t hits = 0;
+        int64_t total = 0;
+        for(uint8_t j=0;j<count;j++) {
+            if(roster[i].rtts[j] < 0) continue;
+            rtts[hits++] = roster[i].rtts[j];
+            total += roster[i].rtts[j];
+        }
+        qsort(rtts, hits, sizeof(int32_t), compare_rtt);
+        synths[i] = roster[i].synth;
+        synths[i].reliability = (float)hits / count;
+        synths[i].avg_rtt_ms = hits ? (float)total / hits : -1;
+        synths[i].p95_rtt_ms = hits ? rtts[hits * 95 / 100] : -1;
+    }
+    free(roster);
+    return found;
+}
@@ -0,0 +1,93 @@
+// liballes.h
+// A host library for driving an Alles mesh from C, and from Python through alles_native.py.
+// It speaks the same protocol as alles.py, built on the firmware's main/wire.h, but packs messages into
+// datagrams as they're made instead of formatting and sending each one, so thousands of events a second
+// with exact times cost a few sendto calls.
+//
+//     alles_host_t *h = alles_open(NULL);
+//     int64_t now = alles_millis();
+//     alles_begin(h); alles_i(h, 't', now); alles_i(h, 'v', 0); alles_i(h, 'w', 1); alles_f(h, 'f', 440); alles_f(h, 'l', 1); alles_end(h);
+//     alles_flush(h);
+//
+// Messages go out when the datagram fills up or on alles_flush, so flush once per burst of events.
+#ifndef __LIBALLES_H
+#define __LIBALLES_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "wire.h"
+
+#define LIBALLES_DATAGRAM_LEN 1400     // default datagram size, an ethernet frame with room for the headers
+#define LIBALLES_MAX_DATAGRAM 4095     // desktop synths read datagrams up to this (MAX_RECEIVE_LEN - 1), ESP32 ones up to the MTU
+#define LIBALLES_MESSAGE_LEN 1024      // longest single message
+#define LIBALLES_SEQUENCE_HEADER_LEN 24 // room for "#<seq>,<session>Z"
+#define LIBALLES_LATENCY_MS 1000       // the synths' default ALLES_LATENCY_MS, how long alles_sync waits for stragglers
+#define LIBALLES_MAX_SYNCS 64          // most syncs one alles_sync sends
+
+typedef struct {
+    int sock;
+    struct sockaddr_in group;          // the mesh's multicast group
+    char datagram[LIBALLES_MAX_DATAGRAM];
+    uint16_t length;                   // bytes waiting in datagram
+    uint16_t datagram_len;             // datagrams are sent before they grow past this
+    uint8_t binary;                    // send messages in the binary format when they fit it
+    uint8_t sequence;                  // number datagrams, so synths drop the copies retries makes
+    uint8_t retries;                   // times each datagram is sent
+    uint32_t sequence_number;
+    uint32_t sequence_session;         // picked at random, so synths don't confuse us with an earlier run or another host
+    // The message alles_begin started, in both formats until we know which it'll be sent in
+    char text[LIBALLES_MESSAGE_LEN];
+    uint16_t text_length;
+    uint8_t body[WIRE_MAX_BODY];
+    uint16_t body_length;
+    uint8_t body_ok;                   // every field so far fits the binary format
+    uint32_t messages;
+    uint32_t datagrams;
+} alles_host_t;
+
+// One synth that answered alles_sync
+typedef struct {
+    uint32_t node;                     // its node ID, r in its replies
+    int32_t client_id;
+    uint32_t ipv4;                     // network order
+    uint8_t battery;                   // battery mask, see alles.py's decode_battery_mask
+    int32_t filtered;                  // messages it dropped as addressed to other synths
+    int32_t clock_error_ms;            // -1 if unknown
+    int32_t latency_ms;
+    int32_t jitter_ms;                 // 95th percentile of how late syncs reach it, -1 if unknown
+    float reliability;                 // fraction of syncs it answered
+    float avg_rtt_ms;
+    int32_t p95_rtt_ms;
+} alles_synth_t;
+
+// Join the mesh through the interface with address local_ip, or the main routable one if NULL. NULL on failure
+alles_host_t *alles_open(const char *local_ip);
+void alles_close(alles_host_t *h);
+// Milliseconds on the same clock as alles.py's millis(), what t and s are measured in
+int64_t alles_millis();
+
+void alles_set_binary(alles_host_t *h, uint8_t on);
+void alles_set_sequence(alles_host_t *h, uint8_t on);
+void alles_set_retries(alles_host_t *h, uint8_t retries);
+void alles_set_datagram_len(alles_host_t *h, uint16_t length);
+// DSCP to mark everything sent with, ALLES_DSCP to begin with, 0 for best effort. 0, or -1 if the OS refused it
+int alles_set_dscp(alles_host_t *h, uint8_t dscp);
+
+// Build a message a field at a time: alles_begin, any number of alles_i and alles_f, then alles_end to queue it
+void alles_begin(alles_host_t *h);
+void alles_i(alles_host_t *h, char tag, int64_t value);
+void alles_f(alles_host_t *h, char tag, float value);
+int alles_end(alles_host_t *h);
+// Queue a whole ASCII message, for fields alles_i and alles_f can't express. A missing Z is added
+int alles_send(alles_host_t *h, const char *message);
+// Queue a message already in wire form, ASCII with its Z or binary, as a relay like allesd has them
+int alles_queue(alles_host_t *h, const void *message, uint16_t length);
+// Send whatever is queued. These return 0, or -1 if sendto failed
+int alles_flush(alles_host_t *h);
+
+// Sync count times, delay_ms apart, and fill synths with whoever answered, by client_id. Returns how many.
+// target_miss_permille and mesh_latency_ms are sync's m and M fields, -1 to leave them out
+int alles_sync(alles_host_t *h, uint8_t count, uint16_t delay_ms, int16_t target_miss_permille, int16_t mesh_latency_ms,
+    alles_synth_t *synths, uint16_t max_synths);
+
+#endif
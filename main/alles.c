@@ -2,12 +2,8 @@
 
 
 extern uint8_t battery_mask;
-extern uint8_t ipv4_quartet;
 extern char githash[8];
 int16_t client_id;
-int64_t clocks[255];
-int64_t ping_times[255];
-uint8_t alive = 1;
 
 extern int64_t computed_delta ; // can be negative no prob, but usually host is larger # than client
 extern uint8_t computed_delta_set ; // have we set a delta yet?
@@ -15,142 +11,314 @@ extern int64_t last_ping_time;
 
 amy_err_t sync_init() {
     client_id = -1; // for now
-    for(uint8_t i=0;i<255;i++) { clocks[i] = 0; ping_times[i] = 0; }
+    clock_sources_init();
+    membership_init();
     return AMY_OK;
 }
 
 
 
-void update_map(uint8_t client, uint8_t ipv4, int64_t time) {
-    // I'm called when I get a sync response or a regular ping packet
-    // I update a map of booted devices.
-
-    //printf("[%d %d] Got a sync response client %d ipv4 %d time %lld\n",  ipv4_quartet, client_id, client , ipv4, time);
-    clocks[ipv4] = time;
-    int64_t my_sysclock = amy_sysclock();
-    ping_times[ipv4] = my_sysclock;
-
-    // Now I basically see what index I would be in the list of booted synths (clocks[i] > 0)
-    // And I set my client_id to that index
-    uint8_t last_alive = alive;
-    uint8_t my_new_client_id = 255;
-    alive = 0;
-    for(uint8_t i=0;i<255;i++) {
-        if(clocks[i] > 0) { 
-            if(my_sysclock < (ping_times[i] + (PING_TIME_MS * 2))) { // alive
-                //printf("[%d %d] Checking my time %lld against ipv4 %d's of %lld, client_id now %d ping_time[%d] = %lld\n", 
-                //    ipv4_quartet, client_id, my_sysclock, i, clocks[i], my_new_client_id, i, ping_times[i]);
-                alive++;
-            } else {
-                //printf("[ipv4 %d client %d] clock %d is dead, ping time was %lld time now is %lld.\n", ipv4_quartet, client_id, i, ping_times[i], my_sysclock);
-                clocks[i] = 0;
-                ping_times[i] = 0;
-            }
-            // If this is not me....
-            if(i != ipv4_quartet) {
-                // predicted time is what we think the alive node should be at by now
-                int64_t predicted_time = (my_sysclock - ping_times[i]) + clocks[i];
-                if(my_sysclock >= predicted_time) my_new_client_id--;
-            } else {
-                my_new_client_id--;
-            }
-        } else {
-            // if clocks[] is 0, no need to check
-            my_new_client_id--;
-        }
-    }
-    if(client_id != my_new_client_id || last_alive != alive) {
-        printf("[%d] my client_id is now %d. %d alive\n", ipv4_quartet, my_new_client_id, alive);
-        client_id = my_new_client_id;
-    }
+// A sync reply waiting for its slot, without the d field and Z that finish it when it goes
+static char sync_reply[100];
+static int64_t sync_reply_received = 0;
+static int64_t sync_reply_due = -1;
+
+static void send_sync_reply(int64_t sysclock) {
+    char message[120];
+    // d says how long we held it, so the host can take that off the round trip
+    sprintf(message, "%sd%lldZ", sync_reply, sysclock - sync_reply_received);
+    mcast_send(message, strlen(message));
+    sync_reply_due = -1;
 }
 
-void handle_sync(int64_t time, int8_t index) {
-    // I am called when I get an s message, which comes along with host time and index
+void handle_sync(int64_t time, int8_t index, int64_t received) {
+    // I am called when I get an s message, which comes along with host time and index,
+    // and when it got here if the network code knows, so time spent waiting to be parsed doesn't count
     int64_t sysclock = amy_sysclock();
-    char message[100];
+    if(received < 0) received = sysclock;
     // Before I send, i want to update the map locally
-    update_map(client_id, ipv4_quartet, sysclock);
-    // Send back sync message with my time and received sync index and my client id & battery status (if any)
-    sprintf(message, "_s%lldi%dc%dr%dy%dZ", sysclock, index, client_id, ipv4_quartet, battery_mask);
-    mcast_send(message, strlen(message));
-    // Update computed delta (i could average these out, but I don't think that'll help too much)
-    //int64_t old_cd = computed_delta;
-    computed_delta = time - sysclock;
-    computed_delta_set = 1;
-    //if(old_cd != computed_delta) printf("Changed computed_delta from %lld to %lld on sync\n", old_cd, computed_delta);
+    update_map(node_id, sysclock);
+    // Update computed delta from the filtered estimate over recent syncs, not just this one
+    clock_sync(time, received);
+    if(sync_reply_due >= 0) send_sync_reply(sysclock);
+    // Send back sync message with the time I got it and received sync index and my client id, node ID & battery status (if any)
+    // how many messages I've dropped as addressed to others, how sure I am of my clock in ms,
+    // the latency I'm playing with and the 95th percentile of how late syncs get to me
+    sprintf(sync_reply, "_s%lldi%dc%dr%" PRIu32 "y%df%" PRIu32 "e%" PRId32 "l%" PRIu32 "j%d", received, index, client_id, node_id, battery_mask,
+        filtered_messages, host_clock->error_ms, (uint32_t)global.latency_ms, jitter_p95_ms);
+    sync_reply_received = received;
+    // Every synth hears the sync at the same moment, so if we all answered at once the replies would collide.
+    // Wait for our own slot instead. client_ids are contiguous, so up to SYNC_REPLY_SLOTS synths never share one
+    uint16_t slots = (alive < SYNC_REPLY_SLOTS) ? alive : SYNC_REPLY_SLOTS;
+    uint16_t slot = (client_id >= 0 && slots > 0) ? client_id % slots : node_id % SYNC_REPLY_SLOTS;
+    sync_reply_due = received + slot * SYNC_REPLY_SLOT_MS;
+    alles_tick(sysclock);
+}
+
+// When alles_tick next has something to do. The loop that parses messages waits for this
+int64_t alles_next_deadline() {
+    int64_t due = last_ping_time + PING_TIME_MS;
+    if(sync_reply_due >= 0 && sync_reply_due < due) due = sync_reply_due;
+    return due;
+}
+
+// Send anything we've held back that's now due, and ping every so often. Called by the loop that parses
+// messages, so no locking. The ping goes through the membership table too, so it has to run there as well
+void alles_tick(int64_t sysclock) {
+    if(sync_reply_due >= 0 && sysclock >= sync_reply_due) send_sync_reply(sysclock);
+    if(sysclock > last_ping_time + PING_TIME_MS) ping(sysclock);
 }
 
 void ping(int64_t sysclock) {
-    char message[100];
-    //printf("[%d %d] pinging with %lld\n", ipv4_quartet, client_id, sysclock);
-    sprintf(message, "_s%lldi-1c%dr%dy%dZ", sysclock, client_id, ipv4_quartet, battery_mask);
-    update_map(client_id, ipv4_quartet, sysclock);
-    mcast_send(message, strlen(message));
+    //printf("[%08" PRIx32 " %d] pinging with %lld\n", node_id, client_id, sysclock);
+    // Where the ping goes, and whether it's a digest, depends on who's the aggregator. See membership.c
+    membership_ping(sysclock);
     last_ping_time = sysclock;
 }
 
 
-void alles_parse_message(char *message, uint16_t length) {
-    uint8_t mode = 0;
-    int16_t client = -1;
-    int64_t sync = -1;
-    int8_t sync_index = -1;
-    uint8_t ipv4 = 0;
-    uint16_t start = 0;
-    uint16_t c = 0;
-
-    // Parse the AMY stuff out of the message first
-    struct i_event e = amy_parse_message(message);
-    uint8_t sync_response = 0;
-
-    // Then pull out any alles-specific modes in this message - c,i,r,s, _
-    while(c < length+1) {
-        uint8_t b = message[c];
-        if(b == '_' && c==0) sync_response = 1;
-        if( ((b >= 'a' && b <= 'z') || (b >= 'A' && b <= 'Z')) || b == 0) {  // new mode or end
-            if(mode=='c') client = atoi(message + start); 
-            if(mode=='i') sync_index = atoi(message + start);
-            if(mode=='r') ipv4=atoi(message + start);
-            if(mode=='s') sync = atol(message + start); 
-            mode = b;
-            start = c + 1;
-        } 
-        c++;
+// Is a message with this client field for me? -1 means everyone
+static uint8_t alles_for_me(int32_t client) {
+    // Assume it's for me
+    uint8_t for_me = 1;
+    // But wait, they specified, so don't assume
+    if(client >= ALLES_WIDE_CLIENT) {
+        // Individual address for meshes past 255 synths, wraps around the same way
+        client -= ALLES_WIDE_CLIENT;
+        // Our own client_id is ours whatever we think alive is, the host may know of more synths than we do yet
+        if(client != client_id && alive>0 && client >= alive) client = client % alive;
+        for_me = (client == client_id);
+    } else if(client >= 0) {
+        for_me = 0;
+        if(client <= 255 && client != client_id) {
+            // If they gave an individual client ID check that it exists
+            if(alive>0) { // alive may get to 0 in a bad situation
+                if(client >= alive) {
+                    client = client % alive;
+                } 
+            }
+        }
+        // It's actually precisely for me
+        if(client == client_id) for_me = 1;
+        if(client > 255) {
+            // It's a group message, see if i'm in the group
+            if(client_id % (client-255) == 0) for_me = 1;
+        }
     }
-    if(sync_response) {
+    return for_me;
+}
+
+// Decide what to do with a message once its alles fields are known. Returns 1 if its event should be played here
+static uint8_t alles_route_message(alles_message_t *m, packet_t *packet) {
+    if(m->sync_response) {
         // If this is a sync response, let's update our local map of who is booted
-        update_map(client, ipv4, sync);
-        length = 0; // don't need to do the rest
+        update_map(m->node, m->sync);
+        // A ping (not an answer to a sync) gets an answer if we're the aggregator
+        if(m->sync_index < 0 && packet) membership_answer_ping(m->node, packet->source, m->shared_host);
+        return 0; // don't need to do the rest
     }
-    // Only do this if we got some data
-    if(length >0) {
-        // TODO -- not that it matters, but the below could probably be one or two lines long instead
-        // Don't add sync messages to the event queue
-        if(sync >= 0 && sync_index >= 0) {
-            handle_sync(sync, sync_index);
+    // Don't add sync messages to the event queue
+    if(m->sync >= 0 && m->sync_index >= 0) {
+        latency_configure(m->miss_permille, m->mesh_latency);
+        handle_sync(m->sync, m->sync_index, packet ? packet->received : -1);
+        return 0;
+    }
+    return (packet && packet->to_me) || alles_for_me(m->client);
+}
+
+uint32_t filtered_messages = 0; // messages dropped by alles_prescan_for_me
+
+// Look at nothing but the addressing of a message, without converting any other field.
+// Returns 0 if it's addressed to other synths, so it can be dropped before the full parse.
+// Sync messages and sync responses are for everyone whatever their c says
+static uint8_t alles_prescan_for_me(char *message, uint16_t length) {
+    int32_t client = -1;
+    if((uint8_t)message[0] == ALLES_BINARY_MAGIC) {
+        uint8_t *m = (uint8_t*)message;
+        uint16_t end = 2 + m[1];
+        if(end > length) return 1; // let the full parse count it as bad
+        for(uint16_t c=2;c<end;) {
+            uint8_t kind = wire_kind(m[c]);
+            if(kind == WIRE_NONE || c + 1 + wire_widths[kind] > end) return 1;
+            if(m[c] == 's') return 1;
+            if(m[c] == 'c') client = wire_get_i32(m + c + 1);
+            c += 1 + wire_widths[kind];
+        }
+    } else {
+        if(message[0] == '_') return 1;
+        for(uint16_t c=0;c<length;c++) {
+            if(message[c] == 's') return 1;
+            if(message[c] == 'c') client = atoi(message + c + 1);
+        }
+    }
+    return alles_for_me(client);
+}
+
+uint32_t binary_message_errors = 0;
+#ifdef ESP_PLATFORM
+uint32_t parse_cycles = 0;   // CPU cycles spent in alles_parse_message, reset by esp_show_debug
+uint32_t parse_messages = 0; // messages those cycles were spent on
+#endif
+
+// Put one of the alles fields where it goes. AMY's own fields are left to amy_parse_message
+static void alles_set_field(alles_message_t *m, uint8_t tag, int64_t i) {
+    switch(tag) {
+        case 'i': m->sync_index = i; break;
+        case 'm': m->miss_permille = i; break;
+        case 'M': m->mesh_latency = i; break;
+        case 'c': m->client = i; break;
+        case 'r': m->node = i; break;
+        case 'h': m->shared_host = i; break;
+        case 't': m->time = i; break;
+        case 's': m->sync = i; break;
+    }
+}
+
+// m and M only mean something to alles on a sync, and h on a synth's ping. Anywhere else they're left to AMY
+static void alles_sync_fields(alles_message_t *m) {
+    if(m->sync < 0) {
+        m->miss_permille = -1;
+        m->mesh_latency = -1;
+    }
+    if(!m->sync_response) m->shared_host = 0;
+}
+
+static void alles_message_init(alles_message_t *m) {
+    m->time = 0;
+    m->client = -1;
+    m->sync = -1;
+    m->sync_index = -1;
+    m->node = 0;
+    m->sync_response = 0;
+    m->shared_host = 0;
+    m->miss_permille = -1;
+    m->mesh_latency = -1;
+}
+
+// Read a binary message's (see wire.h) alles fields, and write all of it out as the ASCII message
+// amy_parse_message takes, so AMY's parser stays the only one that knows its fields. Still several
+// times smaller on the air than sending the ASCII. Returns 0 if it's bad
+static uint8_t alles_parse_binary_message(uint8_t *message, uint16_t length, alles_message_t *m, char *text) {
+    uint16_t end = 2 + message[1];
+    uint16_t c = 2;
+    uint16_t t = 0;
+    if(end > length) return 0;
+    while(c < end) {
+        uint8_t tag = message[c++];
+        uint8_t kind = wire_kind(tag);
+        // An unknown tag means we can't know how far to skip, so give up on the message
+        if(kind == WIRE_NONE || c + wire_widths[kind] > end) return 0;
+        uint8_t *v = message + c;
+        char field[64];
+        int n;
+        if(kind == WIRE_F32) {
+            // No exponents, AMY splits fields on letters
+            n = snprintf(field, sizeof(field), "%c%f", tag, wire_get_f32(v));
+            while(n > 2 && n < (int)sizeof(field) && field[n-1] == '0') n--;
+            if(n > 0 && n < (int)sizeof(field) && field[n-1] == '.') n--;
         } else {
-            // Assume it's for me
-            uint8_t for_me = 1;
-            // But wait, they specified, so don't assume
-            if(client >= 0) {
-                for_me = 0;
-                if(client <= 255) {
-                    // If they gave an individual client ID check that it exists
-                    if(alive>0) { // alive may get to 0 in a bad situation
-                        if(client >= alive) {
-                            client = client % alive;
-                        } 
-                    }
-                }
-                // It's actually precisely for me
-                if(client == client_id) for_me = 1;
-                if(client > 255) {
-                    // It's a group message, see if i'm in the group
-                    if(client_id % (client-255) == 0) for_me = 1;
+            int64_t i = (kind == WIRE_I16) ? wire_get_i16(v) : (kind == WIRE_I32) ? wire_get_i32(v) : wire_get_i64(v);
+            alles_set_field(m, tag, i);
+            n = snprintf(field, sizeof(field), "%c%" PRId64, tag, i);
+        }
+        if(n < 0 || n >= (int)sizeof(field) || t + n >= BINARY_TEXT_LEN) return 0;
+        memcpy(text + t, field, n);
+        t += n;
+        c += wire_widths[kind];
+    }
+    text[t] = 0;
+    alles_sync_fields(m);
+    return 1;
+}
+
+// Character classes for the ASCII tokenizer
+#define TOK_OTHER 0
+#define TOK_TAG 1   // a letter, starts a new field, or the end of the message
+#define TOK_DIGIT 2
+#define TOK_MINUS 3
+static const uint8_t tok_class[256] = {
+    [0] = TOK_TAG, ['a' ... 'z'] = TOK_TAG, ['A' ... 'Z'] = TOK_TAG,
+    ['0' ... '9'] = TOK_DIGIT, ['-'] = TOK_MINUS,
+};
+// The fields alles routes on, everything else is AMY's
+static const uint8_t tok_alles[128] = {
+    ['c'] = 1, ['h'] = 1, ['i'] = 1, ['m'] = 1, ['M'] = 1, ['r'] = 1, ['s'] = 1, ['t'] = 1,
+};
+#define TOK_MAX_VALUE 100000000000000000LL // stop taking digits before the value can overflow
+
+// One pass over an ASCII message for the alles routing fields, instead of a separate atoi walk for
+// each. Only their digits are accumulated, AMY's fields are skipped over and left to amy_parse_message.
+// Like atoi, a value stops at anything that isn't a digit, and a - only counts before the first digit
+void alles_tokenize(char *message, uint16_t length, alles_message_t *m) {
+    alles_message_init(m);
+    uint8_t tag = 0;
+    int64_t value = 0;
+    uint8_t digits = 0;
+    uint8_t negative = 0;
+    uint8_t done = 0; // the value has ended, ignore the rest of the field
+    for(uint16_t c=0;c<=length;c++) {
+        uint8_t b = (c < length) ? message[c] : 0;
+        switch(tok_class[b]) {
+            case TOK_DIGIT:
+                if(!done && value < TOK_MAX_VALUE) {
+                    value = value * 10 + (b - '0');
+                    digits++;
                 }
-            }
-            if(for_me) amy_add_i_event(e);
+                break;
+            case TOK_MINUS:
+                if(digits || negative) done = 1; else negative = 1;
+                break;
+            case TOK_TAG:
+                if(tag < 128 && tok_alles[tag] && digits) alles_set_field(m, tag, negative ? -value : value);
+                tag = b;
+                value = 0;
+                digits = 0;
+                negative = 0;
+                done = 0;
+                break;
+            default:
+                if(c == 0 && b == '_') m->sync_response = 1;
+                done = 1;
+                break;
         }
     }
-}
\ No newline at end of file
+    alles_sync_fields(m);
+}
+
+// Only the loop that parses messages uses this, and it's too big for the ESP32 parse task's stack
+static char binary_text[BINARY_TEXT_LEN];
+
+void alles_parse_message(char *message, uint16_t length, packet_t *packet) {
+#ifdef ESP_PLATFORM
+    uint32_t start_cycles = esp_cpu_get_cycle_count();
+#endif
+    alles_message_t m;
+    if(!(packet && packet->to_me) && !alles_prescan_for_me(message, length)) {
+        // Most individually addressed messages in a big mesh aren't for us, don't bother parsing them
+        filtered_messages++;
+        length = 0;
+    } else if(message[0] == '_' && (message[1] == 'g' || message[1] == 'a')) {
+        // Membership digests and answers, nothing else to do with them
+        membership_message(message, length, packet ? packet->source : 0);
+        length = 0;
+    } else if((uint8_t)message[0] == ALLES_BINARY_MAGIC) {
+        alles_message_init(&m);
+        if(!alles_parse_binary_message((uint8_t*)message, length, &m, binary_text)) {
+            binary_message_errors++;
+            length = 0;
+        }
+        message = binary_text;
+    } else {
+        alles_tokenize(message, length, &m);
+    }
+    // Only do this if we got some data
+    if(length >0) {
+        // Times and syncs are on their sender's clock, so swap its delta in. Synths' replies don't need one
+        if(!m.sync_response && (m.time > 0 || m.sync >= 0)) clock_select(packet ? packet->source : 0, amy_sysclock());
+        if(alles_route_message(&m, packet)) amy_add_i_event(amy_parse_message(message));
+    }
+#ifdef ESP_PLATFORM
+    parse_cycles += esp_cpu_get_cycle_count() - start_cycles;
+    parse_messages++;
+#endif
+}
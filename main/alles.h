@@ -4,6 +4,8 @@
 
 #include <stdio.h>
 #include <stddef.h>
+#include <stdatomic.h>
+#include <inttypes.h>
 #ifdef ESP_PLATFORM
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -20,9 +22,10 @@
 #include "lwip/netdb.h"
 #include "wifi_manager.h"
 #include "driver/gpio.h"
+#include "esp_cpu.h"
 
 
-#define MAX_TASKS 9
+#define MAX_TASKS 10
 
 // Pins & buttons
 #define BUTTON_WAKEUP 34
@@ -43,6 +46,9 @@
 #define CPU_MONITOR_1 12
 #define CPU_MONITOR_2 15
 
+#define MESSAGE_RING_LEN 64     // messages queued between mcast_task and parse_task, power of 2
+
+
 void wifi_reconfigure();
 extern esp_err_t buttons_init();
 void esp_show_debug(uint8_t type);
@@ -54,12 +60,76 @@ void delay_ms(uint32_t ms);
 // Choose to use big pcm patches bank or small -- depends on platform, but both Alles v2 and local can support large. Tulip can't 
 #define ALLES_LATENCY_MS 1000 // fixed default latency in milliseconds, can change
 #include "amy.h"
+#include "wire.h"
 
-#define UDP_PORT 9294        // port to listen on
 #define MULTICAST_TTL 255     // hops multicast packets can take
-#define MULTICAST_IPV4_ADDR "232.10.11.12"
+#define MULTICAST_MAX_GROUPS MULTICAST_GROUP_MAX_DIVISOR // our own group and one per divisor from 2
 #define PING_TIME_MS 10000   // ms between boards pinging each other
+#define ALLES_REBASE_MS 20000 // a message time this far from what we expect re-computes the clock delta
+#ifdef ESP_PLATFORM
+#define ALLES_MAX_NODES 512   // synths the membership table can hold, power of 2. 20 bytes of DRAM each, and 4 more for the indexes
+#else
+#define ALLES_MAX_NODES 4096
+#endif
+#ifdef ESP_PLATFORM
+// The parse task can only wake on a tick, 10ms at the usual 100Hz, so a slot any shorter would be lumped in
+// with the next one. Fewer, whole-tick slots spread the replies over about the same time as on desktop
+#define SYNC_REPLY_SLOT_MS (portTICK_PERIOD_MS > 2 ? portTICK_PERIOD_MS : 2)
+#define SYNC_REPLY_SLOTS (80 / SYNC_REPLY_SLOT_MS > 1 ? 80 / SYNC_REPLY_SLOT_MS : 1)
+#else
+#define SYNC_REPLY_SLOTS 40     // sync replies are spread over this many slots, see handle_sync
+#define SYNC_REPLY_SLOT_MS 2    // room for a few small frames on the air
+#endif
+#define MEMBER_EXPIRE_MS (PING_TIME_MS * 2) // a synth that hasn't pinged for this long is gone
+#define MEMBER_TICK_MS (PING_TIME_MS / 4)    // expiry timer wheel resolution, see membership.c
+#define MEMBER_WHEEL_SLOTS 16                // must cover MEMBER_EXPIRE_MS with a tick to spare
+#define MEMBER_OFFSET_SLACK_MS 1000          // a synth's clock has to move this far for its age order to change
+#define CLOCK_SAMPLES 16      // sync samples the clock estimator keeps, see clock.c
+#define CLOCK_OUTLIER_MS 20   // a best sample this far clear of the next best is ignored
+#define CLOCK_SLEW_MS 2       // most the estimate moves per sync, unless it's off by more than CLOCK_STEP_MS
+#define CLOCK_STEP_MS 100
+#define CLOCK_ROUNDS 8        // rounds of syncs the skew is fitted over
+#define CLOCK_ROUND_GAP_MS 2000 // syncs further apart than this are in different rounds
+#define CLOCK_SKEW_MIN_SPAN_MS 60000 // don't trust a skew fitted over less time than this
+#define CLOCK_MAX_SKEW_PPB 200000 // 200ppm, well past any real crystal
+#define CLOCK_APPLY_MS 100    // how often computed_delta is moved along the skew between syncs
+#define MAX_CLOCK_SOURCES 4   // controllers we keep a clock estimate for, see clock.c
+#define LATENCY_SAMPLES 128   // sync delay samples kept for the jitter percentiles, see clock.c
+#define LATENCY_MIN_SAMPLES 32 // don't adapt latency on fewer samples than this
+#define LATENCY_MARGIN_MS 20  // added to the chosen percentile, covers parsing and a render block
+#define LATENCY_MIN_MS 20
+#define LATENCY_MAX_MS 2000
+#define LATENCY_FALL_MS 10    // most adaptive latency drops per sync, it goes up at once
+#ifndef ALLES_TARGET_MISS_PERMILLE
+#define ALLES_TARGET_MISS_PERMILLE 0 // late messages per 1000 to size latency for, 0 keeps it fixed
+#endif
+#ifdef ESP_PLATFORM
+#define MAX_RECEIVE_LEN 1500 // lwIP doesn't reassemble fragments by default, so nothing bigger than the MTU arrives
+#else
 #define MAX_RECEIVE_LEN 4096
+#endif
+#define BINARY_TEXT_LEN 1024 // a binary message written out as ASCII for amy_parse_message, see alles.c
+#define MAX_SEQUENCE_SOURCES 8 // senders we track sequence numbers for, see packet.c
+#define SEQUENCE_WINDOW 64     // how far back duplicates are remembered per sender
+#define SEQUENCE_EXPIRE_MS 10000 // a sender quiet this long starts afresh
+#define FEC_CACHE_LEN 8        // numbered datagrams kept to rebuild a lost one from parity, also the biggest group
+#define FEC_MAX_DATAGRAM 576   // bigger datagrams aren't kept, so can't be rebuilt
+#define MCAST_RECV_BATCH 16  // datagrams the desktop listener will drain per wakeup
+#ifdef ESP_PLATFORM
+#define OUTBOUND_QUEUE_LEN 8      // messages waiting for the sender task, see mcast_send. Each takes its full size of DRAM
+#else
+#define OUTBOUND_QUEUE_LEN 32
+#endif
+#define OUTBOUND_MESSAGE_LEN 128  // longest message mcast_send takes
+#define OUTBOUND_DATAGRAM_LEN 512 // messages queued together for the same place go out in one datagram up to this
+#define RENDER_BALANCE_BLOCKS 32  // blocks of render time summed before the oscs are split between cores again
+#define RENDER_BALANCE_SLACK 8    // cores within 1/this of the total of each other are balanced enough
+#define RENDER_BALANCE_MAX_STEP 4 // most oscs moved from one core to the other at a time
+#ifdef ESP_PLATFORM
+#define PACKET_POOL_LEN 6    // receive buffers, so several datagrams can be waiting on the parse task
+#else
+#define PACKET_POOL_LEN (MCAST_RECV_BATCH + 1) // the spare is for datagrams rebuilt from parity
+#endif
 
 // enums
 #define DEVBOARD 0
@@ -82,26 +152,146 @@ void delay_ms(uint32_t ms);
 extern char *message_start_pointer;
 extern int16_t message_length;
 
+// A received datagram in the packet pool, see packet.c
+typedef struct {
+    char data[MAX_RECEIVE_LEN];
+    int16_t length;
+    uint32_t source;        // sender's IPv4 address, network order
+    uint16_t port;          // sender's UDP port, network order
+    uint8_t to_me;          // unicast to our node ID, so play it whatever client it's for, see packet_split
+    int64_t received;       // our sysclock when it arrived, -1 if we don't know better than when it's parsed
+    atomic_uint_fast16_t refs;
+} packet_t;
+
+extern packet_t *packet_alloc();
+extern void packet_pool_mark();
+extern void packet_retain(packet_t *packet);
+extern void packet_release(packet_t *packet);
+extern void packet_show_stats();
+extern uint32_t packet_duplicates;
+extern uint32_t packet_lost;
+extern uint32_t fec_recovered;
+extern uint32_t fec_unrecoverable;
+extern uint16_t packet_split(packet_t *packet, void (*deliver)(char *message, uint16_t length, packet_t *packet));
+
+#ifdef ESP_PLATFORM
+// A message living in place inside a pooled packet, waiting to be parsed
+typedef struct {
+    char *message;
+    uint16_t length;
+    packet_t *packet;
+} message_desc_t;
+
+extern uint8_t mcast_ring_pop(message_desc_t *desc);
+extern void mcast_ring_done(message_desc_t *desc);
+extern uint32_t message_ring_overflow;
+#endif
+
 extern void bleep();
 extern void debleep();
 extern void upgrade_tone();
 extern void wifi_tone();
 extern void scale(uint8_t wave);
 
-extern uint8_t alive;
+extern uint16_t alive;
 extern int16_t client_id;
+extern uint32_t node_id;
 
 void ping(int64_t sysclock);
 amy_err_t sync_init();
 
-extern  void update_map(uint8_t client, uint8_t ipv4, int64_t time);
-extern void handle_sync(int64_t time, int8_t index);
+// Clock offset estimator, see clock.c
+typedef struct {
+    int64_t offsets[CLOCK_SAMPLES]; // host time - our receive time, per sync
+    int64_t locals[CLOCK_SAMPLES];  // our receive time, per sync
+    uint8_t count;
+    uint8_t next;
+    uint8_t set;
+    int64_t delta;                  // current estimate, what computed_delta follows
+    int64_t delta_local;            // when delta was estimated
+    int64_t applied_local;          // when computed_delta was last moved along the skew
+    int64_t applied_delta;          // what it was set to, if it's changed since a message re-based it
+    int32_t error_ms;               // spread of the low delay samples, -1 before we have any
+    int64_t skew_ppb;               // how fast the host's clock gains on ours, parts per billion
+    int64_t round_offsets[CLOCK_ROUNDS]; // best sample of each recent round of syncs, for the skew fit
+    int64_t round_locals[CLOCK_ROUNDS];
+    uint8_t rounds;
+    uint8_t round_next;
+    int64_t round_best;             // best sample so far in this round
+    int64_t round_best_local;
+    uint8_t round_samples;
+    int64_t last_local;             // when the last sample arrived
+} clock_estimator_t;
+
+extern clock_estimator_t *host_clock;
+void clock_init(clock_estimator_t *c);
+void clock_sources_init();
+void clock_select(uint32_t source, int64_t sysclock);
+void clock_add_sample(clock_estimator_t *c, int64_t host_time, int64_t local_time);
+int64_t clock_delta_at(clock_estimator_t *c, int64_t now);
+void clock_sync(int64_t host_time, int64_t local_time);
+void clock_apply(int64_t sysclock);
+void clock_show_stats();
+extern uint16_t latency_target_miss_permille;
+extern uint16_t jitter_p50_ms;
+extern uint16_t jitter_p95_ms;
+extern uint16_t jitter_p99_ms;
+void latency_configure(int16_t miss_permille, int16_t mesh_latency_ms);
+
+extern  void update_map(uint32_t node, int64_t time);
+extern void membership_init();
+extern uint32_t alles_node_id(const uint8_t *bytes, uint16_t length);
+extern void membership_ping(int64_t sysclock);
+extern void membership_answer_ping(uint32_t node, uint32_t address, uint8_t shared_host);
+extern void membership_message(char *message, uint16_t length, uint32_t address);
+extern uint8_t alles_multicast_groups(int16_t id, uint32_t *groups);
+extern atomic_bool multicast_groups_dirty;
+extern void handle_sync(int64_t time, int8_t index, int64_t received);
+extern int64_t alles_next_deadline();
+extern void alles_tick(int64_t sysclock);
+// A message waiting to be sent by mcast_send_task
+typedef struct {
+    uint32_t address;       // network order, 0 for the multicast group
+    uint16_t length;
+    char data[OUTBOUND_MESSAGE_LEN];
+} outbound_message_t;
+
 extern void mcast_send(char * message, uint16_t len);
-#ifndef ESP_PLATFORM
+extern void mcast_send_to(uint32_t address, char * message, uint16_t len);
+// Counted from several tasks at once
+extern atomic_uint_fast32_t outbound_dropped;
+extern atomic_uint_fast32_t outbound_messages;
+extern atomic_uint_fast32_t outbound_datagrams;
+#ifdef ESP_PLATFORM
+extern void mcast_send_task(void *pvParameters);
+#else
+extern void *mcast_send_task(void *vargp);
 extern void *mcast_listen_task(void *vargp);
+extern void mcast_show_stats();
+extern uint8_t mcast_dscp;
 #endif
 extern void create_multicast_ipv4_socket();
-void alles_parse_message(char *message, uint16_t length);
+// A message's alles routing fields, filled in one pass by alles_tokenize (or from a binary message)
+typedef struct {
+    int64_t time;           // host time from t, 0 if none
+    int32_t client;
+    int64_t sync;
+    int16_t sync_index;
+    uint32_t node;          // sender's node ID, from r
+    uint8_t sync_response;
+    uint8_t shared_host;    // ping only, from h: other synths share the sender's address, so answer it by multicast
+    int16_t miss_permille;  // sync only, target miss rate for adaptive latency, -1 if none
+    int16_t mesh_latency;   // sync only, latency the host wants the whole mesh on, -1 if none
+} alles_message_t;
+
+void alles_parse_message(char *message, uint16_t length, packet_t *packet);
+void alles_tokenize(char *message, uint16_t length, alles_message_t *m);
+extern uint32_t binary_message_errors;
+extern uint32_t filtered_messages;
+#ifdef ESP_PLATFORM
+extern uint32_t parse_cycles;
+extern uint32_t parse_messages;
+#endif
 
 
 
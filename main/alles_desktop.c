@@ -4,6 +4,7 @@
 #include "alles.h"
 #include <pthread.h>
 #include <unistd.h>
+#include <time.h>
 
 uint8_t board_level = ALLES_DESKTOP;
 uint8_t status = RUNNING;
@@ -17,14 +18,64 @@ extern int16_t amy_device_id;
 
 uint8_t battery_mask = 0;
 
-extern uint8_t ipv4_quartet;
-uint8_t quartet_offset = 0;
+uint8_t node_offset = 0;
 extern int get_first_ip_address(char *host);
 extern void print_devices();
 extern amy_err_t sync_init();
 
 char *local_ip, *raw_file;
 
+static double bench_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Time how many messages per second we can parse, the old way (amy_parse_message then a second walk with
+// atoi for the alles fields) against alles_tokenize's pass for them. AMY parses its own fields either way.
+// Nothing is added to the event queue.
+void parse_bench() {
+    char *messages[] = { "v0w4f440.0l0.9", "v1w1n60l1t123456", "v2a0.5f220.5d0.25P0.1", "c3v0l0.5t1000", "v0A0,1,10,0l1" };
+    uint8_t count = sizeof(messages) / sizeof(messages[0]);
+    uint32_t iterations = 200000;
+    volatile int64_t sink = 0;
+    alles_message_t m;
+
+    double begin = bench_seconds();
+    for(uint32_t n=0;n<iterations;n++) {
+        char *message = messages[n % count];
+        uint16_t length = strlen(message);
+        struct i_event e = amy_parse_message(message);
+        uint8_t mode = 0;
+        uint16_t start = 0;
+        int32_t client = -1;
+        for(uint16_t c=0;c<length+1;c++) {
+            uint8_t b = message[c];
+            if( ((b >= 'a' && b <= 'z') || (b >= 'A' && b <= 'Z')) || b == 0) {
+                if(mode=='c') client = atoi(message + start);
+                if(mode=='i') sink += atoi(message + start);
+                if(mode=='r') sink += atoi(message + start);
+                if(mode=='s') sink += atol(message + start);
+                mode = b;
+                start = c + 1;
+            }
+        }
+        sink += client + e.time;
+    }
+    double two_pass = iterations / (bench_seconds() - begin);
+
+    begin = bench_seconds();
+    for(uint32_t n=0;n<iterations;n++) {
+        char *message = messages[n % count];
+        alles_tokenize(message, strlen(message), &m);
+        struct i_event e = amy_parse_message(message);
+        sink += m.client + e.time;
+    }
+    double one_pass = iterations / (bench_seconds() - begin);
+    printf("atoi per alles field + amy_parse_message:    %.0f messages/s\n", two_pass);
+    printf("alles_tokenize + amy_parse_message:          %.0f messages/s (%.2fx)\n", one_pass, one_pass / two_pass);
+}
+
 int main(int argc, char ** argv) {
     sync_init();
     amy_start();
@@ -37,7 +88,7 @@ int main(int argc, char ** argv) {
     get_first_ip_address(local_ip);
 
     int opt;
-    while((opt = getopt(argc, argv, ":i:d:c:r:o:lgh")) != -1) 
+    while((opt = getopt(argc, argv, ":i:d:c:r:o:m:t:lgbh")) != -1) 
     { 
         switch(opt) 
         { 
@@ -51,8 +102,21 @@ int main(int argc, char ** argv) {
                 amy_device_id = atoi(optarg);
                 break;
             case 'o': 
-                quartet_offset = atoi(optarg);
+                node_offset = atoi(optarg);
                 break; 
+            case 'm':
+                latency_target_miss_permille = atoi(optarg);
+                break;
+            case 't':
+                mcast_dscp = atoi(optarg);
+                break;
+            case 'g':
+                debug_on = 1;
+                break;
+            case 'b':
+                parse_bench();
+                return 0;
+                break;
             case 'l':
                 amy_print_devices();
                 return 0;
@@ -60,8 +124,12 @@ int main(int argc, char ** argv) {
             case 'h':
                 printf("usage: alles\n\t[-i multicast interface ip address, default, autodetect]\n");
                 printf("\t[-d sound device id, use -l to list, default, autodetect]\n");
-                printf("\t[-o offset for client ID, use for multiple copies of this program on the same host, default is 0]\n");
+                printf("\t[-o number mixed into the node ID, not needed for multiple copies of this program on one host, default is 0]\n");
+                printf("\t[-m adapt latency to miss this many messages per 1000, default is 0, fixed latency]\n");
+                printf("\t[-t DSCP to mark sent packets with, 46 is WMM voice, 34 video, 0 best effort, default is %d]\n", ALLES_DSCP);
+                printf("\t[-g print network stats every ping]\n");
                 printf("\t[-l list all sound devices and exit]\n");
+                printf("\t[-b benchmark message parsing and exit]\n");
                 printf("\t[-h show this help and exit]\n");
                 return 0;
                 break;
@@ -75,7 +143,8 @@ int main(int argc, char ** argv) {
     }
     amy_live_start();
     create_multicast_ipv4_socket();
-    pthread_t thread_id;
+    pthread_t thread_id, send_thread_id;
+    pthread_create(&send_thread_id, NULL, mcast_send_task, NULL);
     pthread_create(&thread_id, NULL, mcast_listen_task, NULL);
 
 #ifdef VIRTUAL_MIDI
@@ -73,6 +73,7 @@ extern xQueueHandle gpio_evt_queue;
 // Task handles for the renderers, multicast listener and main
 TaskHandle_t mcastTask = NULL;
 TaskHandle_t parseTask = NULL;
+TaskHandle_t sendTask = NULL;
 TaskHandle_t upgradeTask = NULL;
 TaskHandle_t amy_render_handle[AMY_CORES]; // one per core
 static TaskHandle_t fillbufferTask = NULL;
@@ -89,16 +90,52 @@ extern uint32_t message_counter;
 
 
 
+// Core 0 renders oscs [0, render_split) and core 1 [render_split, AMY_OSCS). A patch can put all its work
+// on low (or high) oscs, so the split starts in the middle and follows how long each core takes to render.
+// Each render task fills its own buffer in one render_task call, so they can't take oscs from a shared
+// counter as they go. Instead the split moves between blocks, while both render tasks are waiting
+static uint8_t render_split = AMY_OSCS/2;
+static uint32_t render_cycles[AMY_CORES];    // this block's, written by each render task
+static uint32_t render_sum[AMY_CORES];       // summed over RENDER_BALANCE_BLOCKS
+static uint16_t render_blocks = 0;
+static uint32_t render_rebalances = 0;
+
+// Called from the fill buffer task after each block, when both render tasks are done with it
+static void render_rebalance() {
+    for(uint8_t i=0;i<AMY_CORES;i++) render_sum[i] += render_cycles[i];
+    if(++render_blocks < RENDER_BALANCE_BLOCKS) return;
+    uint32_t total = render_sum[0] + render_sum[1];
+    int32_t diff = (int32_t)(render_sum[0] - render_sum[1]);
+    if(diff > (int32_t)(total / RENDER_BALANCE_SLACK) || -diff > (int32_t)(total / RENDER_BALANCE_SLACK)) {
+        // AMY doesn't tell us what each osc costs, so assume the busy core's oscs cost the same. Moving
+        // half the difference evens them out, if it's really a few oscs doing the work it takes a few goes
+        uint8_t busy = (diff > 0) ? 0 : 1;
+        uint8_t busy_oscs = busy ? AMY_OSCS - render_split : render_split;
+        uint32_t per_osc = render_sum[busy] / (busy_oscs ? busy_oscs : 1);
+        uint32_t move = ((diff > 0) ? diff : -diff) / 2 / (per_osc ? per_osc : 1);
+        if(move < 1) move = 1;
+        if(move > RENDER_BALANCE_MAX_STEP) move = RENDER_BALANCE_MAX_STEP;
+        // Each core keeps at least one osc
+        if(busy == 0) render_split = (render_split > move) ? render_split - move : 1;
+        else render_split = (render_split + move < AMY_OSCS) ? render_split + move : AMY_OSCS - 1;
+        render_rebalances++;
+    }
+    render_blocks = 0;
+    render_sum[0] = render_sum[1] = 0;
+}
+
 // Wrap AMY's renderer into 2 FreeRTOS tasks, one per core
 void esp_render_task( void * pvParameters) {
     uint8_t which = *((uint8_t *)pvParameters);
-    uint8_t start = (AMY_OSCS/2); 
-    uint8_t end = AMY_OSCS;
-    if(which == 0) { start = 0; end = (AMY_OSCS/2); } 
-    printf("I'm renderer #%d on core #%d and i'm handling oscs %d up until %d\n", which, xPortGetCoreID(), start, end);
+    printf("I'm renderer #%d on core #%d and i'm handling oscs %d up until %d to begin with\n", which, xPortGetCoreID(),
+        which ? render_split : 0, which ? AMY_OSCS : render_split);
     while(1) {
         ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        uint8_t start = which ? render_split : 0;
+        uint8_t end = which ? AMY_OSCS : render_split;
+        uint32_t start_cycles = esp_cpu_get_cycle_count();
         render_task(start, end, which);
+        render_cycles[which] = esp_cpu_get_cycle_count() - start_cycles;
         xTaskNotifyGive(fillbufferTask);
     }
 }
@@ -108,6 +145,7 @@ void esp_render_task( void * pvParameters) {
 void esp_fill_audio_buffer_task() {
     while(1) {
         int16_t *block = fill_audio_buffer_task();
+        render_rebalance();
         size_t written = 0;
         i2s_channel_write(tx_handle, block, AMY_BLOCK_SIZE * BYTES_PER_SAMPLE, &written, portMAX_DELAY);
         if(written != AMY_BLOCK_SIZE*BYTES_PER_SAMPLE) {
@@ -117,11 +155,25 @@ void esp_fill_audio_buffer_task() {
 }
 
 // Make AMY's parse task run forever, as a FreeRTOS task (with notifications)
+// Each wakeup drains every message the listener has queued on the ring. It also wakes up
+// when a held back sync reply or a ping is due, as those are sent from here. That keeps everything that
+// touches the membership table on this task
 void esp_parse_task() {
+    message_desc_t desc;
     while(1) {
-        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
-        alles_parse_message(message_start_pointer, message_length);
-        xTaskNotifyGive(mcastTask);
+        TickType_t wait = portMAX_DELAY;
+        int64_t due = alles_next_deadline();
+        if(due >= 0) {
+            int64_t ms = due - amy_sysclock();
+            // Round up to the tick, so a reply slot a tick away goes on that tick and not the one after
+            wait = (ms > 0) ? pdMS_TO_TICKS(ms + portTICK_PERIOD_MS - 1) : 0;
+        }
+        ulTaskNotifyTake(pdTRUE, wait);
+        while(mcast_ring_pop(&desc)) {
+            alles_parse_message(desc.message, desc.length, desc.packet);
+            mcast_ring_done(&desc);
+        }
+        alles_tick(amy_sysclock());
     }
 }
 
@@ -156,7 +208,7 @@ amy_err_t esp_amy_init() {
 void esp_show_debug(uint8_t type) { 
     TaskStatus_t *pxTaskStatusArray;
     volatile UBaseType_t uxArraySize, x, i;
-    const char* const tasks[] = { "render_task0", "render_task1", "mcast_task", "parse_task", "main", "fill_audio_buff", "wifi", "idle0", "idle1", 0 }; 
+    const char* const tasks[] = { "render_task0", "render_task1", "mcast_task", "parse_task", "send_task", "main", "fill_audio_buff", "wifi", "idle0", "idle1", 0 }; 
     uxArraySize = uxTaskGetNumberOfTasks();
     pxTaskStatusArray = pvPortMalloc( uxArraySize * sizeof( TaskStatus_t ) );
     uxArraySize = uxTaskGetSystemState( pxTaskStatusArray, uxArraySize, NULL );
@@ -195,6 +247,15 @@ void esp_show_debug(uint8_t type) {
         printf("%-15s\t%-15ld\t\t%2.2f%%\n", tasks[i], counter_since_last[i], (float)counter_since_last[i]/ulTotalRunTime * 100.0);
     }   
     printf("------\nEvent queue size %d / %d. Received %" PRIu32 " events and %" PRIu32 " messages\n", global.event_qsize, AMY_EVENT_FIFO_LEN, event_counter, message_counter);
+    printf("Message ring overflowed %" PRIu32 " times. %" PRIu32 " bad binary messages, %" PRIu32 " filtered as not for me\n", message_ring_overflow, binary_message_errors, filtered_messages);
+    printf("Sent %" PRIu32 " messages in %" PRIu32 " datagrams, %" PRIu32 " dropped with the send queue full\n", (uint32_t)atomic_load(&outbound_messages),
+        (uint32_t)atomic_load(&outbound_datagrams), (uint32_t)atomic_load(&outbound_dropped));
+    printf("Core 0 renders oscs 0 to %d, core 1 the rest, after %" PRIu32 " rebalances\n", render_split - 1, render_rebalances);
+    packet_show_stats();
+    clock_show_stats();
+    if(parse_messages) printf("Parsing took %" PRIu32 " cycles per message over %" PRIu32 " messages\n", parse_cycles / parse_messages, parse_messages);
+    parse_cycles = 0;
+    parse_messages = 0;
     event_counter = 0;
     message_counter = 0;
     vPortFree(pxTaskStatusArray);
@@ -439,6 +500,8 @@ void app_main() {
 
     // Create the task that waits for UDP messages, parses them and puts them on the sequencer queue (core 1)
     xTaskCreatePinnedToCore(&esp_parse_task, "parse_task", 4096, NULL, (ESP_TASK_PRIO_MIN +2), &parseTask, 0);
+    // Create the task that sends everything we send over UDP (core 2)
+    xTaskCreatePinnedToCore(&mcast_send_task, "send_task", 4096, NULL, (ESP_TASK_PRIO_MIN + 2), &sendTask, 1);
     // Create the task that listens fro new incoming UDP messages (core 2)
     xTaskCreatePinnedToCore(&mcast_listen_task, "mcast_task", 4096, NULL, (ESP_TASK_PRIO_MIN + 3), &mcastTask, 1);
 
@@ -0,0 +1,273 @@
+// clock.c
+// Estimates the offset between the host's clock and ours from sync messages.
+// Each sync gives one sample, host time minus our receive time. WiFi only ever delays a packet, so the
+// samples with the least delay have the largest offset and are the closest to the truth. We keep a
+// window of recent samples, trust the largest (unless it sticks out on its own, which network delay
+// can't cause), and slew computed_delta towards it a little at a time so scheduled notes don't jump.
+//
+// Crystals also run at slightly different rates, so the offset drifts between syncs. Syncs come in
+// rounds (alles.py's sync() sends ten, 100ms apart). We keep the least delayed offset of each of the
+// last few rounds and fit a line through them: its slope is our skew against the host, in parts per
+// billion. Samples in the window are moved along that line to the present before being compared, and
+// computed_delta keeps moving along it between syncs.
+//
+// How late each sync arrives compared to the least delayed ones is also what a message sent at the same
+// moment loses of its latency budget. We keep the last few hundred of those delays and their percentiles,
+// and if the host gives us a target miss rate (sync field m, or -m on desktop) we set global.latency_ms to
+// the matching percentile plus a margin. We report our latency in sync replies and pings, so the host can
+// pick the largest and send it back to everyone (sync field M) for the whole mesh to play together.
+//
+// Every controller has its own clock, so we keep an estimator and a computed_delta for each one we get
+// timed messages or syncs from, by source address. Before one of those is parsed clock_select swaps its
+// sender's delta into AMY's computed_delta, so two laptops syncing the same mesh don't re-base each other.
+
+#include "alles.h"
+
+extern int64_t computed_delta;
+extern uint8_t computed_delta_set;
+
+typedef struct {
+    uint32_t source;          // sender's IPv4 address, network order, 0 if we don't know it
+    int64_t last_heard;       // 0 for a free slot
+    int64_t computed_delta;   // AMY's computed_delta for this sender, while another one's is swapped in
+    uint8_t computed_delta_set;
+    clock_estimator_t clock;
+} clock_source_t;
+
+static clock_source_t clock_sources[MAX_CLOCK_SOURCES];
+static clock_source_t *clock_current = &clock_sources[0];
+// The selected sender's estimator, the one the last sync came from after handle_sync
+clock_estimator_t *host_clock = &clock_sources[0].clock;
+
+void clock_init(clock_estimator_t *c) {
+    memset(c, 0, sizeof(clock_estimator_t));
+    c->error_ms = -1;
+}
+
+// Where an offset measured at local time from will have drifted to by local time to
+static inline int64_t clock_drift(clock_estimator_t *c, int64_t offset, int64_t from, int64_t to) {
+    return offset + (c->skew_ppb * (to - from)) / 1000000000LL;
+}
+
+// Pick the offset the window agrees on as of local time now, and how far the low delay samples spread around it
+static void clock_estimate(clock_estimator_t *c, int64_t now, int64_t *target, int32_t *error_ms) {
+    int64_t sorted[CLOCK_SAMPLES];
+    for(uint8_t i=0;i<c->count;i++) sorted[i] = clock_drift(c, c->offsets[i], c->locals[i], now);
+    // Largest first. The window is tiny, insertion sort is fine
+    for(uint8_t i=1;i<c->count;i++) {
+        int64_t v = sorted[i];
+        int8_t j = i - 1;
+        while(j >= 0 && sorted[j] < v) { sorted[j+1] = sorted[j]; j--; }
+        sorted[j+1] = v;
+    }
+    uint8_t best = 0;
+    if(c->count > 2 && sorted[0] - sorted[1] > CLOCK_OUTLIER_MS) best = 1;
+    *target = sorted[best];
+    *error_ms = sorted[best] - sorted[best + (c->count - best) / 4];
+}
+
+// A round of syncs is over, remember its best sample and refit the skew. Only runs once a round, so doubles are ok
+static void clock_end_round(clock_estimator_t *c) {
+    c->round_offsets[c->round_next] = c->round_best;
+    c->round_locals[c->round_next] = c->round_best_local;
+    c->round_next = (c->round_next + 1) % CLOCK_ROUNDS;
+    if(c->rounds < CLOCK_ROUNDS) c->rounds++;
+    c->round_samples = 0;
+
+    int64_t first = c->round_locals[0], last = c->round_locals[0];
+    double mean_x = 0, mean_y = 0;
+    for(uint8_t i=0;i<c->rounds;i++) {
+        if(c->round_locals[i] < first) first = c->round_locals[i];
+        if(c->round_locals[i] > last) last = c->round_locals[i];
+        mean_x += c->round_locals[i] - c->round_locals[0];
+        mean_y += c->round_offsets[i] - c->round_offsets[0];
+    }
+    // Need rounds spread out enough that WiFi jitter doesn't swamp the drift
+    if(c->rounds < 2 || last - first < CLOCK_SKEW_MIN_SPAN_MS) return;
+    mean_x /= c->rounds;
+    mean_y /= c->rounds;
+    double sxy = 0, sxx = 0;
+    for(uint8_t i=0;i<c->rounds;i++) {
+        double dx = (c->round_locals[i] - c->round_locals[0]) - mean_x;
+        double dy = (c->round_offsets[i] - c->round_offsets[0]) - mean_y;
+        sxy += dx * dy;
+        sxx += dx * dx;
+    }
+    int64_t skew = (int64_t)(sxy / sxx * 1e9);
+    if(skew > CLOCK_MAX_SKEW_PPB) skew = CLOCK_MAX_SKEW_PPB;
+    if(skew < -CLOCK_MAX_SKEW_PPB) skew = -CLOCK_MAX_SKEW_PPB;
+    c->skew_ppb = skew;
+}
+
+// Add a sync sample: the host's time in the message and our sysclock when it arrived
+void clock_add_sample(clock_estimator_t *c, int64_t host_time, int64_t local_time) {
+    int64_t offset = host_time - local_time;
+    // Way off from where we are, so the host restarted or changed clocks. Start over
+    if(c->count && (offset > clock_delta_at(c, local_time) + ALLES_REBASE_MS || offset < clock_delta_at(c, local_time) - ALLES_REBASE_MS)) {
+        clock_init(c);
+    }
+    if(c->round_samples && local_time - c->last_local > CLOCK_ROUND_GAP_MS) clock_end_round(c);
+    if(!c->round_samples || offset > c->round_best) {
+        c->round_best = offset;
+        c->round_best_local = local_time;
+    }
+    c->round_samples++;
+    c->last_local = local_time;
+
+    c->offsets[c->next] = offset;
+    c->locals[c->next] = local_time;
+    c->next = (c->next + 1) % CLOCK_SAMPLES;
+    if(c->count < CLOCK_SAMPLES) c->count++;
+
+    int64_t target;
+    int64_t delta = clock_delta_at(c, local_time);
+    clock_estimate(c, local_time, &target, &c->error_ms);
+    // Until the window is half full each new best sample is a real improvement, so go straight to it
+    if(!c->set || c->count < CLOCK_SAMPLES/2 || target > delta + CLOCK_STEP_MS || target < delta - CLOCK_STEP_MS) {
+        delta = target;
+        c->set = 1;
+    } else if(target > delta + CLOCK_SLEW_MS) {
+        delta += CLOCK_SLEW_MS;
+    } else if(target < delta - CLOCK_SLEW_MS) {
+        delta -= CLOCK_SLEW_MS;
+    } else {
+        delta = target;
+    }
+    c->delta = delta;
+    c->delta_local = local_time;
+}
+
+// The estimate as of local time now, carried along the skew since the last sync
+int64_t clock_delta_at(clock_estimator_t *c, int64_t now) {
+    return clock_drift(c, c->delta, c->delta_local, now);
+}
+
+uint16_t latency_target_miss_permille = ALLES_TARGET_MISS_PERMILLE;
+uint16_t jitter_p50_ms = 0;
+uint16_t jitter_p95_ms = 0;
+uint16_t jitter_p99_ms = 0;
+static uint16_t latency_delays[LATENCY_SAMPLES];
+static uint16_t latency_count = 0;
+static uint16_t latency_next = 0;
+
+static uint16_t latency_percentile(uint16_t *sorted, uint16_t miss_permille) {
+    uint16_t i = ((uint32_t)latency_count * (1000 - miss_permille)) / 1000;
+    return sorted[(i < latency_count) ? i : latency_count - 1];
+}
+
+// Redo the percentiles after a new sample, and move latency towards the target if we have one
+static void latency_update() {
+    uint16_t sorted[LATENCY_SAMPLES];
+    for(uint16_t i=0;i<latency_count;i++) {
+        uint16_t v = latency_delays[i];
+        int16_t j = i - 1;
+        while(j >= 0 && sorted[j] > v) { sorted[j+1] = sorted[j]; j--; }
+        sorted[j+1] = v;
+    }
+    jitter_p50_ms = latency_percentile(sorted, 500);
+    jitter_p95_ms = latency_percentile(sorted, 50);
+    jitter_p99_ms = latency_percentile(sorted, 10);
+    if(!latency_target_miss_permille || latency_count < LATENCY_MIN_SAMPLES) return;
+    int32_t want = latency_percentile(sorted, latency_target_miss_permille) + LATENCY_MARGIN_MS;
+    if(want < LATENCY_MIN_MS) want = LATENCY_MIN_MS;
+    if(want > LATENCY_MAX_MS) want = LATENCY_MAX_MS;
+    // Late notes are worse than a little more delay, so go up at once but come down slowly
+    int32_t latency = global.latency_ms;
+    if(want < latency - LATENCY_FALL_MS) want = latency - LATENCY_FALL_MS;
+    global.latency_ms = want;
+}
+
+// How much longer than the least delayed syncs a sync took to get here, in ms
+static void latency_add_sample(int64_t delay) {
+    if(delay < 0) delay = 0;
+    if(delay > UINT16_MAX) delay = UINT16_MAX;
+    latency_delays[latency_next] = delay;
+    latency_next = (latency_next + 1) % LATENCY_SAMPLES;
+    if(latency_count < LATENCY_SAMPLES) latency_count++;
+    latency_update();
+}
+
+// From the m and M fields of a sync, -1 if not there. A mesh latency fixes latency and stops adapting it
+void latency_configure(int16_t miss_permille, int16_t mesh_latency_ms) {
+    if(miss_permille >= 0 && miss_permille < 1000) latency_target_miss_permille = miss_permille;
+    if(mesh_latency_ms >= 0) {
+        latency_target_miss_permille = 0;
+        global.latency_ms = mesh_latency_ms;
+    }
+}
+
+void clock_sources_init() {
+    memset(clock_sources, 0, sizeof(clock_sources));
+    for(uint8_t i=0;i<MAX_CLOCK_SOURCES;i++) clock_init(&clock_sources[i].clock);
+    clock_current = &clock_sources[0];
+    host_clock = &clock_current->clock;
+}
+
+// Make source's clock the one computed_delta is, before parsing a timed message or sync from it
+void clock_select(uint32_t source, int64_t sysclock) {
+    if(clock_current->source != source || !clock_current->last_heard) {
+        // Keep where the last sender's delta got to, amy_parse_message may have re-based it
+        clock_current->computed_delta = computed_delta;
+        clock_current->computed_delta_set = computed_delta_set;
+        clock_source_t *found = NULL;
+        clock_source_t *oldest = &clock_sources[0];
+        for(uint8_t i=0;i<MAX_CLOCK_SOURCES;i++) {
+            if(clock_sources[i].source == source && clock_sources[i].last_heard) found = &clock_sources[i];
+            if(clock_sources[i].last_heard < oldest->last_heard) oldest = &clock_sources[i];
+        }
+        if(found == NULL) {
+            // New sender, take over whoever we heard from longest ago
+            found = oldest;
+            memset(found, 0, sizeof(clock_source_t));
+            clock_init(&found->clock);
+            found->source = source;
+        }
+        clock_current = found;
+        host_clock = &found->clock;
+        computed_delta = found->computed_delta;
+        computed_delta_set = found->computed_delta_set;
+    }
+    clock_current->last_heard = sysclock;
+    clock_apply(sysclock);
+}
+
+// Called from handle_sync with the host's time from an s message, after clock_select has picked its sender
+void clock_sync(int64_t host_time, int64_t local_time) {
+    clock_add_sample(host_clock, host_time, local_time);
+    latency_add_sample(host_clock->delta - (host_time - local_time));
+    //int64_t old_cd = computed_delta;
+    computed_delta = host_clock->delta;
+    computed_delta_set = 1;
+    host_clock->applied_local = local_time;
+    host_clock->applied_delta = computed_delta;
+    //if(old_cd != computed_delta) printf("Changed computed_delta from %lld to %lld on sync\n", old_cd, computed_delta);
+}
+
+// Called from clock_select, keeps computed_delta following the skew between syncs.
+// It only moves by a fraction of a ms per CLOCK_APPLY_MS, so there's no need to do the math every time
+void clock_apply(int64_t sysclock) {
+    if(!host_clock->set) return;
+    if(computed_delta != host_clock->applied_delta) {
+        // amy_parse_message re-based it, the host restarted or its clock wrapped.
+        // What we had is stale, so drop it rather than undo the re-base, and start again from the next sync
+        clock_init(host_clock);
+        return;
+    }
+    if(!host_clock->skew_ppb || sysclock - host_clock->applied_local < CLOCK_APPLY_MS) return;
+    computed_delta = clock_delta_at(host_clock, sysclock);
+    host_clock->applied_local = sysclock;
+    host_clock->applied_delta = computed_delta;
+}
+
+void clock_show_stats() {
+    for(uint8_t i=0;i<MAX_CLOCK_SOURCES;i++) {
+        clock_source_t *s = &clock_sources[i];
+        if(!s->last_heard) continue;
+        uint8_t *ip = (uint8_t*)&s->source;
+        printf("clock %d.%d.%d.%d: delta %" PRId64 " from %d samples, error %" PRId32 " ms, skew %" PRId64 " ppb over %d rounds\n",
+            ip[0], ip[1], ip[2], ip[3], clock_delta_at(&s->clock, amy_sysclock()), s->clock.count, s->clock.error_ms,
+            s->clock.skew_ppb, s->clock.rounds);
+    }
+    printf("latency: %" PRIu32 " ms, target miss %d/1000, sync delay p50 %d p95 %d p99 %d ms over %d samples\n",
+        (uint32_t)global.latency_ms, latency_target_miss_permille, jitter_p50_ms, jitter_p95_ms, jitter_p99_ms, latency_count);
+}
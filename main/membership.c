@@ -0,0 +1,358 @@
+// membership.c
+// Which synths are alive, and from that our client_id.
+// Synths are known by their node ID (see alles_node_id), kept in a hash table of up to ALLES_MAX_NODES.
+// Every synth pings (and answers syncs) with its sysclock. A synth whose clock is ahead of ours booted
+// before us, and our client_id is how many alive synths booted before us. Rather than go over every synth
+// on each ping, we keep the count of alive synths older than us up to date as pings come in, and expire
+// synths that stop pinging with a timer wheel: each alive synth sits in the wheel slot of the tick it
+// expires on, so each update only looks at the slots the clock has moved through.
+//
+// If every synth multicast its ping to every other, each would handle the whole mesh's pings every
+// period. Instead the oldest synth (client_id 0) is the aggregator. It multicasts one digest a period
+// (_g<node>,<clock>,<alive>,<successor>,<shared>Z) and everyone else sends their ping to it alone. It
+// answers each ping with that synth's client_id and the number alive (_a<node>,<client_id>,<alive>Z),
+// worked out from a list of the synths it knows sorted by age. So apart from the aggregator a synth
+// handles a couple of messages a period however big the mesh is. If the digests stop, the successor
+// named in them (the next oldest) takes over straight away, and everyone else goes back to multicasting
+// pings and working out their own client_id. Only if no digest turns up for another period does the
+// oldest synth they can then hear take over. If two synths both think they're the aggregator, each hears
+// the other's digest and the younger one stands down.
+//
+// Several desktop synths can share an address. A datagram sent to that address reaches only one of them,
+// maybe not the one it's for. A synth that hears another synth's ping from its own address says so in its
+// pings (h1) and keeps multicasting them, and the aggregator answers those pings by multicast. If the
+// aggregator shares its address, its digests say so and everyone multicasts their pings to it.
+//
+// Each synth also joins multicast groups for its client_id and the small client groups it's in (see
+// alles_multicast_groups), so a switch or AP that snoops IGMP only sends it traffic meant for it.
+
+#include "alles.h"
+
+extern uint32_t node_id;
+extern int16_t client_id;
+extern uint8_t battery_mask;
+
+#define NO_MEMBER 0xFFFF
+
+typedef struct {
+    uint32_t id;           // node ID, 0 for a free entry
+    uint32_t ping_time;    // the low 32 bits of our sysclock when its last ping got here
+    int32_t offset;        // its clock minus ours, how much longer it's been running, see member_offset
+    uint16_t hash_next;    // next entry in the same hash bucket, or the free list
+    uint16_t wheel_next;
+    uint16_t wheel_prev;
+    uint8_t wheel_slot;
+    uint8_t older;         // its clock is ahead of ours, so it counts towards our client_id
+} member_t;
+
+uint16_t alive = 1;
+static uint16_t alive_count = 0;
+static uint16_t older_alive = 0;
+static member_t members[ALLES_MAX_NODES];
+static uint16_t buckets[ALLES_MAX_NODES];
+static uint16_t by_age[ALLES_MAX_NODES]; // alive members, oldest (largest offset) first
+static uint16_t free_members = NO_MEMBER;
+static uint16_t wheel_heads[MEMBER_WHEEL_SLOTS];
+static int64_t wheel_tick = -1;          // the wheel has been expired up to the tick before this one
+
+static uint32_t aggregator_node = 0;     // who we send our pings to, 0 if nobody
+static uint32_t aggregator_address = 0;
+static int64_t aggregator_offset = 0;
+static int64_t aggregator_heard = 0;     // our sysclock at its last digest
+static uint32_t aggregator_successor = 0; // who it says takes over from it
+static uint8_t aggregator_shared = 0;    // other synths share its address, so pings to it are multicast
+
+static uint32_t own_address = 0;         // ours, from our own multicasts coming back to us
+static int64_t address_shared_heard = 0; // our sysclock when another synth was last heard from our address
+
+// FNV-1a over whatever identifies this synth, the MAC on ESP. Never 0, and positive so it fits the r field
+uint32_t alles_node_id(const uint8_t *bytes, uint16_t length) {
+    uint32_t h = 2166136261UL;
+    for(uint16_t i=0;i<length;i++) {
+        h ^= bytes[i];
+        h *= 16777619UL;
+    }
+    h &= 0x7FFFFFFF;
+    return h ? h : 1;
+}
+
+// Offsets are kept in 32 bits to keep the table small on ESP. Synths booted more than about 24 days
+// apart still sort the right way round, they just sort level with anyone else that far out
+static inline int32_t member_offset(int64_t offset) {
+    if(offset > INT32_MAX) return INT32_MAX;
+    if(offset < -INT32_MAX) return -INT32_MAX;
+    return offset;
+}
+
+static inline uint16_t member_bucket(uint32_t id) {
+    // ids from old firmware are small numbers, so mix before taking the low bits
+    return ((uint32_t)(id * 2654435761UL) >> 16) & (ALLES_MAX_NODES - 1);
+}
+
+void membership_init() {
+    alive_count = 0;
+    older_alive = 0;
+    memset(members, 0, sizeof(members));
+    for(uint16_t i=0;i<ALLES_MAX_NODES;i++) {
+        buckets[i] = NO_MEMBER;
+        members[i].hash_next = (i + 1 < ALLES_MAX_NODES) ? i + 1 : NO_MEMBER;
+    }
+    free_members = 0;
+    for(uint8_t i=0;i<MEMBER_WHEEL_SLOTS;i++) wheel_heads[i] = NO_MEMBER;
+    wheel_tick = -1;
+    aggregator_node = 0;
+    aggregator_successor = 0;
+    aggregator_shared = 0;
+    address_shared_heard = 0;
+}
+
+static uint16_t member_find(uint32_t id) {
+    uint16_t i = buckets[member_bucket(id)];
+    while(i != NO_MEMBER && members[i].id != id) i = members[i].hash_next;
+    return i;
+}
+
+// How many alive members are older than a synth with this offset, which is its client_id
+static uint16_t rank_of(int32_t offset) {
+    uint16_t lo = 0, hi = alive_count;
+    while(lo < hi) {
+        uint16_t mid = (lo + hi) / 2;
+        if(members[by_age[mid]].offset > offset) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+// by_age only changes when synths come, go or restart, so moving the tail along is fine
+static void age_insert(uint16_t i) {
+    uint16_t at = rank_of(members[i].offset);
+    memmove(&by_age[at + 1], &by_age[at], (alive_count - at) * sizeof(uint16_t));
+    by_age[at] = i;
+}
+
+static void age_remove(uint16_t i) {
+    uint16_t at = rank_of(members[i].offset);
+    while(by_age[at] != i) at++;
+    memmove(&by_age[at], &by_age[at + 1], (alive_count - at - 1) * sizeof(uint16_t));
+}
+
+static void wheel_unlink(uint16_t i) {
+    member_t *m = &members[i];
+    if(m->wheel_prev != NO_MEMBER) members[m->wheel_prev].wheel_next = m->wheel_next; else wheel_heads[m->wheel_slot] = m->wheel_next;
+    if(m->wheel_next != NO_MEMBER) members[m->wheel_next].wheel_prev = m->wheel_prev;
+}
+
+static void wheel_link(uint16_t i, int64_t expires) {
+    member_t *m = &members[i];
+    m->wheel_slot = (expires / MEMBER_TICK_MS) % MEMBER_WHEEL_SLOTS;
+    m->wheel_prev = NO_MEMBER;
+    m->wheel_next = wheel_heads[m->wheel_slot];
+    if(m->wheel_next != NO_MEMBER) members[m->wheel_next].wheel_prev = i;
+    wheel_heads[m->wheel_slot] = i;
+}
+
+static void member_set_older(member_t *m, uint8_t older) {
+    if(older == m->older) return;
+    m->older = older;
+    if(older) older_alive++; else older_alive--;
+}
+
+static void member_remove(uint16_t i) {
+    member_t *m = &members[i];
+    uint16_t *link = &buckets[member_bucket(m->id)];
+    while(*link != i) link = &members[*link].hash_next;
+    *link = m->hash_next;
+    member_set_older(m, 0);
+    wheel_unlink(i);
+    age_remove(i);
+    m->id = 0;
+    m->hash_next = free_members;
+    free_members = i;
+    alive_count--;
+}
+
+static void member_refresh(uint32_t id, int64_t time, int64_t sysclock) {
+    int32_t offset = member_offset(time - sysclock);
+    uint16_t i = member_find(id);
+    if(i != NO_MEMBER) {
+        wheel_unlink(i);
+        // Network delay moves the offset around a little, only re-sort if it restarted or drifted a lot
+        if((int64_t)offset > (int64_t)members[i].offset + MEMBER_OFFSET_SLACK_MS || (int64_t)offset < (int64_t)members[i].offset - MEMBER_OFFSET_SLACK_MS) {
+            age_remove(i);
+            members[i].offset = offset;
+            alive_count--;
+            age_insert(i);
+            alive_count++;
+        }
+    } else {
+        // A full table means a mesh bigger than we can track, the newcomer just isn't counted
+        if(free_members == NO_MEMBER) return;
+        i = free_members;
+        free_members = members[i].hash_next;
+        uint16_t b = member_bucket(id);
+        members[i].id = id;
+        members[i].older = 0;
+        members[i].offset = offset;
+        members[i].hash_next = buckets[b];
+        buckets[b] = i;
+        age_insert(i);
+        alive_count++;
+    }
+    members[i].ping_time = (uint32_t)sysclock;
+    member_set_older(&members[i], id != node_id && members[i].offset > 0);
+    wheel_link(i, sysclock + MEMBER_EXPIRE_MS);
+}
+
+// Drop everyone who hasn't pinged for MEMBER_EXPIRE_MS. Only the slots for ticks since the last call
+// are looked at, and the current one again as its synths may not be due yet
+static void member_expire(int64_t sysclock) {
+    int64_t tick = sysclock / MEMBER_TICK_MS;
+    int64_t from = wheel_tick;
+    if(from < 0 || tick - from >= MEMBER_WHEEL_SLOTS) from = tick - MEMBER_WHEEL_SLOTS + 1;
+    for(int64_t t=from;t<=tick;t++) {
+        uint16_t i = wheel_heads[t % MEMBER_WHEEL_SLOTS];
+        while(i != NO_MEMBER) {
+            uint16_t next = members[i].wheel_next;
+            if((uint32_t)sysclock - members[i].ping_time >= MEMBER_EXPIRE_MS) member_remove(i);
+            i = next;
+        }
+    }
+    wheel_tick = tick;
+}
+
+// Are we sending our pings to an aggregator that's still sending digests?
+static uint8_t membership_following(int64_t sysclock) {
+    return aggregator_node && sysclock - aggregator_heard < MEMBER_EXPIRE_MS;
+}
+
+atomic_bool multicast_groups_dirty = 0; // client_id changed, the network loop rejoins our groups
+
+// The multicast groups past the main one a synth with client_id id listens on, host order. Returns how many.
+// Group messages (client 256+d) for small d go to 232.12.0.d, bigger groups would take too many joins
+uint8_t alles_multicast_groups(int16_t id, uint32_t *groups) {
+    uint8_t count = 0;
+    if(id < 0) return 0;
+    groups[count++] = MULTICAST_CLIENT_BASE + (uint16_t)id;
+    for(uint8_t d=2;d<=MULTICAST_GROUP_MAX_DIVISOR;d++) {
+        if(id % d == 0) groups[count++] = MULTICAST_GROUP_BASE + d;
+    }
+    return count;
+}
+
+static void membership_set_client_id(int16_t id, uint16_t count) {
+    if(client_id != id || alive != count) {
+        printf("[%08" PRIx32 "] my client_id is now %d. %d alive\n", node_id, id, count);
+    }
+    if(client_id != id) atomic_store(&multicast_groups_dirty, 1);
+    client_id = id;
+    alive = count;
+}
+
+void update_map(uint32_t node, int64_t time) {
+    // I'm called when I get a sync response or a regular ping packet
+    // I update a map of booted devices.
+    if(node == 0) return;
+    int64_t my_sysclock = amy_sysclock();
+    if(time > 0) {
+        member_refresh(node, time, my_sysclock);
+    } else {
+        uint16_t i = member_find(node);
+        if(i != NO_MEMBER) member_remove(i);
+    }
+    member_expire(my_sysclock);
+    // While following an aggregator our client_id comes from it, we only hear from a few synths ourselves
+    if(!membership_following(my_sysclock)) {
+        // My client_id is my index in the list of booted synths, oldest first
+        membership_set_client_id(older_alive, alive_count);
+    }
+}
+
+// Note who a ping or digest came from, to find out if other synths share our address
+static void membership_heard(uint32_t node, uint32_t address, int64_t sysclock) {
+    if(address == 0) return;
+    if(node == node_id) own_address = address;
+    else if(address == own_address) address_shared_heard = sysclock;
+}
+
+static uint8_t membership_address_shared(int64_t sysclock) {
+    return address_shared_heard && sysclock - address_shared_heard < MEMBER_EXPIRE_MS;
+}
+
+// Whether we can start sending digests. When the aggregator goes quiet its successor takes over, and
+// everyone else gives the multicast pings a period to tell them who the oldest is now
+static uint8_t membership_may_aggregate(int64_t sysclock) {
+    return aggregator_node == 0 || aggregator_successor == node_id || sysclock - aggregator_heard >= MEMBER_EXPIRE_MS + PING_TIME_MS;
+}
+
+// Our ping for this period. Called from ping() instead of multicasting it ourselves
+void membership_ping(int64_t sysclock) {
+    char message[100];
+    update_map(node_id, sysclock);
+    uint8_t shared = membership_address_shared(sysclock);
+    if(!membership_following(sysclock) && older_alive == 0 && membership_may_aggregate(sysclock)) {
+        // Nobody older is alive, so we're the aggregator. The next oldest takes over if we go away
+        uint32_t successor = 0;
+        for(uint16_t i=0;i<alive_count && i<2;i++) {
+            if(members[by_age[i]].id != node_id) { successor = members[by_age[i]].id; break; }
+        }
+        sprintf(message, "_g%" PRIu32 ",%lld,%d,%" PRIu32 ",%dZ", node_id, sysclock, alive_count, successor, shared);
+        mcast_send(message, strlen(message));
+        return;
+    }
+    sprintf(message, "_s%lldi-1c%dr%" PRIu32 "y%dl%" PRIu32 "%sZ", sysclock, client_id, node_id, battery_mask,
+        (uint32_t)global.latency_ms, shared ? "h1" : "");
+    if(membership_following(sysclock) && !shared && !aggregator_shared) {
+        mcast_send_to(aggregator_address, message, strlen(message));
+    } else {
+        mcast_send(message, strlen(message));
+    }
+}
+
+// A ping from a synth reached us. If we're the aggregator, tell it where it is in the mesh
+void membership_answer_ping(uint32_t node, uint32_t address, uint8_t shared_host) {
+    char message[48];
+    int64_t sysclock = amy_sysclock();
+    membership_heard(node, address, sysclock);
+    if(node == node_id || address == 0 || older_alive != 0 || membership_following(sysclock) || !membership_may_aggregate(sysclock)) return;
+    uint16_t i = member_find(node);
+    if(i == NO_MEMBER) return;
+    sprintf(message, "_a%" PRIu32 ",%d,%dZ", node, rank_of(members[i].offset), alive_count);
+    // Sent to its address it could reach one of the other synths there instead
+    if(shared_host) mcast_send(message, strlen(message)); else mcast_send_to(address, message, strlen(message));
+}
+
+// A digest (_g) or an answer to our ping (_a), from address
+void membership_message(char *message, uint16_t length, uint32_t address) {
+    char *p = message + 2;
+    int64_t sysclock = amy_sysclock();
+    uint32_t node = strtoul(p, &p, 10);
+    if(*p++ != ',' || node == 0) return;
+    if(message[1] == 'g') {
+        int64_t clock = strtoll(p, &p, 10);
+        membership_heard(node, address, sysclock);
+        if(node == node_id) return;
+        // Older synths' digests stop after the clock
+        uint32_t successor = 0;
+        uint8_t shared = 0;
+        if(*p == ',') strtol(p + 1, &p, 10);
+        if(*p == ',') successor = strtoul(p + 1, &p, 10);
+        if(*p == ',') shared = strtol(p + 1, &p, 10);
+        update_map(node, clock);
+        int64_t offset = clock - sysclock;
+        // Only follow a synth older than us, and the oldest aggregator we can hear
+        if(offset <= 0) return;
+        if(!membership_following(sysclock) || node == aggregator_node || offset > aggregator_offset) {
+            aggregator_node = node;
+            aggregator_address = address;
+            aggregator_offset = offset;
+            aggregator_heard = sysclock;
+            aggregator_successor = successor;
+            aggregator_shared = shared;
+        }
+    } else if(message[1] == 'a') {
+        // On a desktop running several copies, an answer can reach the wrong one
+        if(node != node_id || !membership_following(sysclock)) return;
+        int16_t id = strtol(p, &p, 10);
+        if(*p++ != ',') return;
+        membership_set_client_id(id, strtol(p, NULL, 10));
+    }
+}
@@ -1,4 +1,7 @@
 // multicast_desktop.c
+#ifdef __linux__
+#define _GNU_SOURCE // for recvmmsg
+#endif
 #include "alles.h"
 #include <stdio.h>
 #include <stddef.h>
@@ -13,18 +16,30 @@
 #include <string.h>
 #include <ifaddrs.h>
 #include <netdb.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
 
 extern void deserialize_event(char * message, uint16_t length);
 extern void ping(int64_t sysclock);
+extern uint8_t debug_on;
 
 int sock= -1;
-uint8_t ipv4_quartet;
-extern uint8_t quartet_offset;
-char udp_message[MAX_RECEIVE_LEN];
+uint8_t mcast_dscp = ALLES_DSCP; // -t, 0 for best effort
+static struct sockaddr_in mcast_dest; // the multicast group, looked up once in create_multicast_ipv4_socket
+uint32_t node_id;
+extern uint8_t node_offset;
 extern char *message_start_pointer;
 extern char *local_ip;
 extern int16_t message_length;
 uint32_t udp_message_counter = 0;
+uint32_t udp_packet_counter = 0;  // datagrams received
+uint32_t udp_wakeup_counter = 0;  // times the listener woke up and read at least one datagram
+uint16_t udp_batch_max = 0;       // most datagrams drained in a single wakeup
 int64_t last_ping_time = PING_TIME_MS; // do the first ping at 10s in to wait for other synths to announce themselves
 
 
@@ -65,8 +80,14 @@ int socket_add_ipv4_multicast_group() {
     inet_pton(AF_INET, MULTICAST_IPV4_ADDR, &(imreq.imr_multiaddr.s_addr));
     inet_pton(AF_INET, local_ip, &(iaddr.s_addr));
 
-    // Get the ipv4 "quartet" (last # of 4) and add the offset to it if one
-    ipv4_quartet = ((iaddr.s_addr & 0xFF000000) >> 24) + quartet_offset;
+    // Our node ID is a hash of the whole address, the offset if one and our pid, so
+    // copies of this program on one host, or hosts on different subnets, don't collide
+    uint8_t id_bytes[9];
+    uint32_t pid = getpid();
+    memcpy(id_bytes, &iaddr.s_addr, 4);
+    id_bytes[4] = node_offset;
+    memcpy(id_bytes + 5, &pid, 4);
+    node_id = alles_node_id(id_bytes, sizeof(id_bytes));
 
     // Assign the IPv4 multicast source interface, via its IP
     err = setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &iaddr,
@@ -90,6 +111,49 @@ int socket_add_ipv4_multicast_group() {
 
 }
 
+static uint32_t joined_groups[MULTICAST_MAX_GROUPS]; // host order, see mcast_update_groups
+static uint8_t joined_count = 0;
+
+// Join (IP_ADD_MEMBERSHIP) or leave (IP_DROP_MEMBERSHIP) one of the per-client groups, host order
+static int socket_set_ipv4_multicast_group(uint32_t group, int option) {
+    struct ip_mreq imreq;
+    imreq.imr_multiaddr.s_addr = htonl(group);
+    inet_pton(AF_INET, local_ip, &(imreq.imr_interface.s_addr));
+    return setsockopt(sock, IPPROTO_IP, option, &imreq, sizeof(struct ip_mreq));
+}
+
+static uint8_t group_in(uint32_t group, uint32_t *groups, uint8_t count) {
+    for(uint8_t i=0;i<count;i++) if(groups[i] == group) return 1;
+    return 0;
+}
+
+// Our client_id changed, so move over to its multicast groups. Groups in both sets are left alone
+static void mcast_update_groups() {
+    uint32_t groups[MULTICAST_MAX_GROUPS];
+    uint32_t joined[MULTICAST_MAX_GROUPS];
+    uint8_t count = alles_multicast_groups(client_id, groups);
+    uint8_t still_joined = 0;
+    for(uint8_t i=0;i<joined_count;i++) {
+        if(group_in(joined_groups[i], groups, count)) {
+            joined[still_joined++] = joined_groups[i];
+        } else {
+            socket_set_ipv4_multicast_group(joined_groups[i], IP_DROP_MEMBERSHIP);
+        }
+    }
+    for(uint8_t i=0;i<count;i++) {
+        if(group_in(groups[i], joined_groups, joined_count)) continue;
+        // Not fatal, the main group still gets us everything
+        if(socket_set_ipv4_multicast_group(groups[i], IP_ADD_MEMBERSHIP) < 0) {
+            fprintf(stderr, "Failed to join group %d.%d.%d.%d. Error %d\n",
+                (int)(groups[i] >> 24), (int)(groups[i] >> 16) & 0xFF, (int)(groups[i] >> 8) & 0xFF, (int)groups[i] & 0xFF, errno);
+        } else {
+            joined[still_joined++] = groups[i];
+        }
+    }
+    memcpy(joined_groups, joined, sizeof(joined));
+    joined_count = still_joined;
+}
+
 void create_multicast_ipv4_socket(void) {
     struct sockaddr_in saddr = { 0 };
     sock = -1;
@@ -125,6 +189,21 @@ void create_multicast_ipv4_socket(void) {
         exit(EXIT_FAILURE);
     }
 
+    // Have the kernel stamp each datagram with when it arrived, for syncs. See received_sysclock
+#ifdef SO_TIMESTAMPNS
+    err = setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &yes, sizeof(int));
+#else
+    err = setsockopt(sock, SOL_SOCKET, SO_TIMESTAMP, &yes, sizeof(int));
+#endif
+    if(err<0) fprintf(stderr, "Can't set receive timestamps %d, syncs will use parse time\n", errno);
+
+    // Mark what we send so the access point queues it as voice, see ALLES_DSCP
+    if(mcast_dscp) {
+        int tos = mcast_dscp << 2;
+        err = setsockopt(sock, IPPROTO_IP, IP_TOS, &tos, sizeof(int));
+        if(err<0) fprintf(stderr, "Can't set DSCP %d, sending best effort %d\n", mcast_dscp, errno);
+    }
+
     uint8_t loopback_val = 1;
     err = setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP,
                      &loopback_val, sizeof(uint8_t));
@@ -136,102 +215,319 @@ void create_multicast_ipv4_socket(void) {
     err = socket_add_ipv4_multicast_group();
     if(err) exit(EXIT_FAILURE);
 
-    printf("Multicast IF is %s. Client tag (not ID) is %d. Listening on %s:%d\n", local_ip, ipv4_quartet, MULTICAST_IPV4_ADDR, UDP_PORT);
+    // Where mcast_send sends to, looked up here once rather than on every send
+    mcast_dest.sin_family = AF_INET;
+    mcast_dest.sin_port = htons(UDP_PORT);
+    inet_pton(AF_INET, MULTICAST_IPV4_ADDR, &mcast_dest.sin_addr);
+
+    printf("Multicast IF is %s. Node ID (not client ID) is %08" PRIx32 ". Listening on %s:%d\n", local_ip, node_id, MULTICAST_IPV4_ADDR, UDP_PORT);
 }
 
 
+// Outbound messages go on a queue for mcast_send_task, so the network and parse loops never wait on sendto
+static outbound_message_t outbound_queue[OUTBOUND_QUEUE_LEN];
+static uint16_t outbound_head = 0;
+static uint16_t outbound_count = 0;
+static pthread_mutex_t outbound_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t outbound_ready = PTHREAD_COND_INITIALIZER;
+atomic_uint_fast32_t outbound_dropped = 0;
+atomic_uint_fast32_t outbound_messages = 0;
+atomic_uint_fast32_t outbound_datagrams = 0;
+
+// Send to one synth (or the host) instead of everyone, address in network order
+void mcast_send_to(uint32_t address, char * message, uint16_t len) {
+    if(len > OUTBOUND_MESSAGE_LEN) {
+        fprintf(stderr, "message too long to send: %d\n", len);
+        return;
+    }
+    pthread_mutex_lock(&outbound_lock);
+    if(outbound_count == OUTBOUND_QUEUE_LEN) {
+        atomic_fetch_add_explicit(&outbound_dropped, 1, memory_order_relaxed);
+    } else {
+        outbound_message_t *m = &outbound_queue[(outbound_head + outbound_count) % OUTBOUND_QUEUE_LEN];
+        m->address = address;
+        m->length = len;
+        memcpy(m->data, message, len);
+        outbound_count++;
+        pthread_cond_signal(&outbound_ready);
+    }
+    pthread_mutex_unlock(&outbound_lock);
+}
+
 void mcast_send(char * message, uint16_t len) {
-    struct addrinfo hints = {
-        .ai_flags = AI_PASSIVE,
-        .ai_socktype = SOCK_DGRAM,
-    };
-    struct addrinfo *res;
-    hints.ai_family = AF_INET; // For an IPv4 socket
-    int err = getaddrinfo(MULTICAST_IPV4_ADDR, NULL, &hints, &res);
+    mcast_send_to(0, message, len);
+}
+
+static void send_datagram(uint32_t address, char *data, uint16_t len) {
+    struct sockaddr_in daddr = mcast_dest;
+    if(address) daddr.sin_addr.s_addr = address;
+    int err = sendto(sock, data, len, 0, (struct sockaddr *)&daddr, sizeof(daddr));
     if (err < 0) {
-        fprintf(stderr, "getaddrinfo() failed for IPV4 destination address. error: %d", err);
+        fprintf(stderr, "IPV4 sendto failed. errno: %d\n", errno);
     }
-    if (res == 0) {
-        fprintf(stderr, "getaddrinfo() did not return any addresses");
+    atomic_fetch_add_explicit(&outbound_datagrams, 1, memory_order_relaxed);
+}
+
+// called from pthread. Takes everything queued at once, and sends runs of messages
+// to the same place as one datagram, they're Z delimited so they split apart again on arrival
+void *mcast_send_task(void *vargp) {
+    outbound_message_t batch[OUTBOUND_QUEUE_LEN];
+    char datagram[OUTBOUND_DATAGRAM_LEN];
+    while(1) {
+        pthread_mutex_lock(&outbound_lock);
+        while(outbound_count == 0) pthread_cond_wait(&outbound_ready, &outbound_lock);
+        uint16_t count = outbound_count;
+        for(uint16_t i=0;i<count;i++) batch[i] = outbound_queue[(outbound_head + i) % OUTBOUND_QUEUE_LEN];
+        outbound_head = (outbound_head + count) % OUTBOUND_QUEUE_LEN;
+        outbound_count = 0;
+        pthread_mutex_unlock(&outbound_lock);
+
+        uint16_t length = 0;
+        uint32_t address = 0;
+        for(uint16_t i=0;i<count;i++) {
+            if(length && (batch[i].address != address || length + batch[i].length > OUTBOUND_DATAGRAM_LEN)) {
+                send_datagram(address, datagram, length);
+                length = 0;
+            }
+            address = batch[i].address;
+            memcpy(datagram + length, batch[i].data, batch[i].length);
+            length += batch[i].length;
+            atomic_fetch_add_explicit(&outbound_messages, 1, memory_order_relaxed);
+        }
+        if(length) send_datagram(address, datagram, length);
     }
-    ((struct sockaddr_in *)res->ai_addr)->sin_port = htons(UDP_PORT);
-    err = sendto(sock, message, len, 0, res->ai_addr, res->ai_addrlen);
-    freeaddrinfo(res);
-    if (err < 0) {
-        fprintf(stderr, "IPV4 sendto failed. errno: %d", errno);
+    return NULL;
+}
+
+static void parse_udp_message(char *message, uint16_t length, packet_t *packet) {
+    message_start_pointer = message;
+    message_length = length;
+    alles_parse_message(message_start_pointer, message_length, packet);
+}
+
+// Break a packet up into messages and parse each one in place
+static void parse_udp_packet(packet_t *packet) {
+    udp_message_counter += packet_split(packet, parse_udp_message);
+}
+
+// Room for the receive timestamp, a timespec on linux and a timeval elsewhere
+#define RX_CONTROL_LEN CMSG_SPACE(sizeof(struct timespec))
+
+// Turn the kernel's receive timestamp on a datagram into our sysclock, or -1 if it doesn't have one.
+// The stamp is wall clock time and AMY's sysclock is its own clock, so work out how long ago the
+// datagram arrived (against now, the wall clock when sysclock was read) and take that off sysclock
+static int64_t received_sysclock(struct msghdr *msg, int64_t sysclock, struct timespec *now) {
+    int64_t age_us = -1;
+    for(struct cmsghdr *c = CMSG_FIRSTHDR(msg); c != NULL; c = CMSG_NXTHDR(msg, c)) {
+        if(c->cmsg_level != SOL_SOCKET) continue;
+#ifdef SCM_TIMESTAMPNS
+        if(c->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+            age_us = (now->tv_sec - ts.tv_sec) * 1000000LL + (now->tv_nsec - ts.tv_nsec) / 1000;
+        }
+#else
+        if(c->cmsg_type == SCM_TIMESTAMP) {
+            struct timeval tv;
+            memcpy(&tv, CMSG_DATA(c), sizeof(tv));
+            age_us = (now->tv_sec - tv.tv_sec) * 1000000LL + (now->tv_nsec / 1000 - tv.tv_usec);
+        }
+#endif
     }
+    // No stamp, or the wall clock was stepped in between
+    if(age_us < 0 || age_us > ALLES_LATENCY_MS * 1000LL) return -1;
+    return sysclock - age_us / 1000;
 }
 
+// Read every datagram waiting on the socket, up to one per free packet. Returns how many, or -1 on error
+static int16_t recv_udp_batch() {
+    packet_t *packets[MCAST_RECV_BATCH];
+    int16_t batch = 0;
+    while(batch < MCAST_RECV_BATCH && (packets[batch] = packet_alloc()) != NULL) batch++;
+    int16_t received = 0;
+#ifdef __linux__
+    struct mmsghdr msgs[MCAST_RECV_BATCH];
+    struct iovec iovecs[MCAST_RECV_BATCH];
+    struct sockaddr_in6 raddrs[MCAST_RECV_BATCH]; // Large enough for both IPv4 or IPv6
+    char controls[MCAST_RECV_BATCH][RX_CONTROL_LEN];
+    memset(msgs, 0, sizeof(msgs));
+    for(int16_t i=0;i<batch;i++) {
+        iovecs[i].iov_base = packets[i]->data;
+        iovecs[i].iov_len = MAX_RECEIVE_LEN-1;
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &raddrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(raddrs[i]);
+        msgs[i].msg_hdr.msg_control = controls[i];
+        msgs[i].msg_hdr.msg_controllen = RX_CONTROL_LEN;
+    }
+    // MSG_DONTWAIT: we were woken for at least one, take whatever else has queued up behind it
+    received = recvmmsg(sock, msgs, batch, MSG_DONTWAIT, NULL);
+    if(received < 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            received = 0;
+        } else {
+            fprintf(stderr, "multicast recvmmsg failed: errno %d\n", errno);
+        }
+    }
+    int64_t sysclock = amy_sysclock();
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    for(int16_t i=0;i<received;i++) {
+        packets[i]->length = msgs[i].msg_len;
+        packets[i]->source = ((struct sockaddr_in *)&raddrs[i])->sin_addr.s_addr;
+        packets[i]->port = ((struct sockaddr_in *)&raddrs[i])->sin_port;
+        packets[i]->received = received_sysclock(&msgs[i].msg_hdr, sysclock, &now);
+    }
+#else
+    // No recvmmsg here (macOS), so drain the socket one recvmsg at a time without blocking
+    while(received < batch) {
+        struct sockaddr_in6 raddr; // Large enough for both IPv4 or IPv6
+        char control[RX_CONTROL_LEN];
+        struct iovec iov = { .iov_base = packets[received]->data, .iov_len = MAX_RECEIVE_LEN-1 };
+        struct msghdr msg = {
+            .msg_name = &raddr, .msg_namelen = sizeof(raddr),
+            .msg_iov = &iov, .msg_iovlen = 1,
+            .msg_control = control, .msg_controllen = RX_CONTROL_LEN,
+        };
+        ssize_t len = recvmsg(sock, &msg, MSG_DONTWAIT);
+        if(len < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "multicast recvfrom failed: errno %d\n", errno);
+                if(received == 0) received = -1;
+            }
+            break;
+        }
+        packets[received]->length = len;
+        packets[received]->source = ((struct sockaddr_in *)&raddr)->sin_addr.s_addr;
+        packets[received]->port = ((struct sockaddr_in *)&raddr)->sin_port;
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        packets[received]->received = received_sysclock(&msg, amy_sysclock(), &now);
+        received++;
+    }
+#endif
+    // Hand back the packets nothing arrived in before counting the pool's high water, then parse
+    int16_t filled = (received > 0) ? received : 0;
+    for(int16_t i=filled;i<batch;i++) packet_release(packets[i]);
+    packet_pool_mark();
+    for(int16_t i=0;i<filled;i++) {
+        parse_udp_packet(packets[i]);
+        packet_release(packets[i]);
+    }
+    return received;
+}
 
+void mcast_show_stats() {
+    printf("network: %" PRIu32 " messages in %" PRIu32 " datagrams over %" PRIu32 " wakeups (%.2f per wakeup, max %d)\n",
+        udp_message_counter, udp_packet_counter, udp_wakeup_counter,
+        udp_wakeup_counter ? (float)udp_packet_counter / udp_wakeup_counter : 0.0, udp_batch_max);
+    printf("network: %" PRIu32 " bad binary messages, %" PRIu32 " filtered as not for me\n", binary_message_errors, filtered_messages);
+    printf("network: sent %" PRIu32 " messages in %" PRIu32 " datagrams, %" PRIu32 " dropped with the send queue full\n",
+        (uint32_t)atomic_load(&outbound_messages), (uint32_t)atomic_load(&outbound_datagrams), (uint32_t)atomic_load(&outbound_dropped));
+    packet_show_stats();
+    clock_show_stats();
+}
 
-// called from pthread
-void *mcast_listen_task(void *vargp) {
+#ifdef __linux__
+int epoll_fd = -1;
+int timer_fd = -1;
+int64_t timer_deadline = -1;
+
+// Block until the socket is readable or sysclock reaches deadline. Returns >0 if readable, 0 on deadline, <0 on error
+static int wait_for_socket(int64_t sysclock, int64_t deadline) {
+    if(epoll_fd < 0) {
+        epoll_fd = epoll_create1(0);
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = timer_fd };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+        ev.data.fd = sock;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev);
+    }
+    // Only touch the timer when the deadline moves, so a busy socket costs no extra syscalls
+    if(deadline != timer_deadline) {
+        int64_t wait_ms = deadline - sysclock + 1;
+        if(wait_ms < 1) wait_ms = 1;
+        struct itimerspec its = { 0 };
+        its.it_value.tv_sec = wait_ms / 1000;
+        its.it_value.tv_nsec = (wait_ms % 1000) * 1000000;
+        timerfd_settime(timer_fd, 0, &its, NULL);
+        timer_deadline = deadline;
+    }
+    struct epoll_event events[2];
+    int n = epoll_wait(epoll_fd, events, 2, -1);
+    if(n < 0) return (errno == EINTR) ? 0 : -1;
+    int readable = 0;
+    for(int i=0;i<n;i++) {
+        if(events[i].data.fd == sock) {
+            readable = 1;
+        } else {
+            uint64_t expirations;
+            if(read(timer_fd, &expirations, sizeof(expirations)) < 0) { /* spurious, nothing to clear */ }
+            timer_deadline = -1;
+        }
+    }
+    return readable;
+}
+#else
+// No epoll here (macOS), so select with a timeout that runs out exactly at the deadline
+static int wait_for_socket(int64_t sysclock, int64_t deadline) {
+    int64_t wait_ms = deadline - sysclock + 1;
+    if(wait_ms < 1) wait_ms = 1;
     struct timeval tv = {
-        .tv_sec =  1,
-        .tv_usec = 0,
+        .tv_sec = wait_ms / 1000,
+        .tv_usec = (wait_ms % 1000) * 1000,
     };
+    fd_set rfds;
+    FD_ZERO(&rfds);
+    FD_SET(sock, &rfds);
+    int s = select(sock + 1, &rfds, NULL, NULL, &tv);
+    if(s < 0) return (errno == EINTR) ? 0 : -1;
+    return (s > 0 && FD_ISSET(sock, &rfds));
+}
+#endif
 
-    int16_t full_message_length;
+// called from pthread
+void *mcast_listen_task(void *vargp) {
     while (1) {
-        // set destination multicast addresses for sending from these sockets
-        //struct sockaddr_in sdestv4 = {
-        //    .sin_family = AF_INET,
-         //   .sin_port = htons(UDP_PORT),
-        //};
-        // We know this inet_aton will pass because we did it above already
-        //inet_pton(AF_INET, MULTICAST_IPV4_ADDR, &(sdestv4.sin_addr.s_addr));
-
         int err = 1;
         while (err > 0) { 
-            fd_set rfds;
-            FD_ZERO(&rfds);
-            FD_SET(sock, &rfds);
-
-            int s = select(sock + 1, &rfds, NULL, NULL, &tv);
+            // Send sync replies whose slot has come, and ping every so often
+            int64_t sysclock = amy_sysclock();
+            int64_t pinged = last_ping_time;
+            alles_tick(sysclock);
+            if(debug_on && last_ping_time != pinged) mcast_show_stats();
+            if(atomic_exchange(&multicast_groups_dirty, 0)) mcast_update_groups();
+            // Sleep until there's traffic, the next ping is due or there's a reply to send
+            int s = wait_for_socket(sysclock, alles_next_deadline());
             if (s < 0) {
-                fprintf(stderr, "Select failed: errno %d\n", errno);
+                fprintf(stderr, "Waiting on socket failed: errno %d\n", errno);
                 err = -1;
                 break;
             }
             else if (s > 0) {
-                if (FD_ISSET(sock, &rfds)) {
-                    // Incoming UDP packet received
-                    // Turn on the CPU monitor to see how long parsing takes
-                    struct sockaddr_in6 raddr; // Large enough for both IPv4 or IPv6
-                    socklen_t socklen = sizeof(raddr);
-                    full_message_length = recvfrom(sock, udp_message, sizeof(udp_message)-1, 0,
-                                       (struct sockaddr *)&raddr, &socklen);
-                    if (full_message_length < 0) {
-                        fprintf(stderr, "multicast recvfrom failed: errno %d\n", errno);
-                        err = -1;
-                        break;
-                    }
-                    udp_message[full_message_length] = 0;
-                    uint16_t start = 0;
-                    // Break the packet up into messages (delimited by Z.)
-                    for(uint16_t i=0;i<full_message_length;i++) {
-                        if(udp_message[i] == 'Z') {
-                            udp_message[i] = 0;
-                            udp_message_counter++;
-                            message_start_pointer = udp_message + start;
-                            message_length = i - start;
-                            alles_parse_message(message_start_pointer, message_length);
-                            start = i+1;
-                        }
-                    }
+                // Incoming UDP packets received, parse all of them before waiting again
+                int16_t received = recv_udp_batch();
+                if (received < 0) {
+                    err = -1;
+                    break;
+                }
+                if (received > 0) {
+                    udp_wakeup_counter++;
+                    udp_packet_counter += received;
+                    if(received > udp_batch_max) udp_batch_max = received;
                 }
             } 
-            // Do a ping every so often
-            int64_t sysclock = amy_sysclock();
-            if(sysclock > (last_ping_time+PING_TIME_MS)) {
-                ping(sysclock);
-            }
-            usleep(THREAD_USLEEP);
         }
 
         fprintf(stderr, "Shutting down socket and restarting...\n");
+#ifdef __linux__
+        if(epoll_fd >= 0) { close(epoll_fd); close(timer_fd); }
+        epoll_fd = -1;
+        timer_fd = -1;
+        timer_deadline = -1;
+#endif
         shutdown(sock, 0);
         close(sock);
     }
 }
-
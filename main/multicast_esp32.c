@@ -5,6 +5,7 @@
 #include <math.h>
 
 #include <esp_timer.h>
+#include <esp_mac.h>
 
 #include "alles.h"
 
@@ -12,21 +13,28 @@ static const char *TAG = "multicast";
 static const char *V4TAG = "mcast-ipv4";
 
 int sock= -1;
+static QueueHandle_t outbound_queue = NULL;
+static struct sockaddr_in mcast_dest; // the multicast group, looked up once in create_multicast_ipv4_socket
+static struct in_addr mcast_if;       // our address, the interface we join groups on
+static uint32_t joined_groups[MULTICAST_MAX_GROUPS]; // host order, see mcast_update_groups
+static uint8_t joined_count = 0;
 
 extern void deserialize_event(char * message, uint16_t length);
 
-extern esp_ip4_addr_t wifi_manager_ip4;
 extern uint8_t battery_mask;
 extern TaskHandle_t parseTask;
+extern TaskHandle_t mcastTask;
 
-uint8_t ipv4_quartet;
-
-char udp_message[MAX_RECEIVE_LEN];
-
-
-extern char *message_start_pointer;
-extern int16_t message_length;
+uint32_t node_id;
 
+// Single producer (mcast_task) / single consumer (parse_task) ring of messages waiting to be parsed.
+// head is only written by the producer, tail only by the consumer, so no locks are needed.
+static message_desc_t message_ring[MESSAGE_RING_LEN];
+static atomic_uint_fast32_t message_ring_head = 0;
+static atomic_uint_fast32_t message_ring_tail = 0;
+// Set while mcast_task is blocked waiting on the parse task for ring space or a free packet
+static atomic_bool listener_waiting = false;
+uint32_t message_ring_overflow = 0; // times the ring was full and the listener had to wait
 
 
 extern void delay_ms(uint32_t ms);
@@ -49,6 +57,7 @@ static int socket_add_ipv4_multicast_group(bool assign_source_if) {
         goto err;
     }
     inet_addr_from_ip4addr(&iaddr, &ip_info.ip);
+    mcast_if = iaddr;
     // Configure multicast address to listen to
     err = inet_aton(MULTICAST_IPV4_ADDR, &imreq.imr_multiaddr.s_addr);
     if (err != 1) {
@@ -84,6 +93,45 @@ static int socket_add_ipv4_multicast_group(bool assign_source_if) {
     return err;
 }
 
+// Join (IP_ADD_MEMBERSHIP) or leave (IP_DROP_MEMBERSHIP) one of the per-client groups, host order
+static int socket_set_ipv4_multicast_group(uint32_t group, int option) {
+    struct ip_mreq imreq = { 0 };
+    imreq.imr_multiaddr.s_addr = htonl(group);
+    imreq.imr_interface = mcast_if;
+    return setsockopt(sock, IPPROTO_IP, option, &imreq, sizeof(struct ip_mreq));
+}
+
+static uint8_t group_in(uint32_t group, uint32_t *groups, uint8_t count) {
+    for(uint8_t i=0;i<count;i++) if(groups[i] == group) return 1;
+    return 0;
+}
+
+// Our client_id changed, so move over to its multicast groups. Groups in both sets are left alone
+static void mcast_update_groups() {
+    uint32_t groups[MULTICAST_MAX_GROUPS];
+    uint32_t joined[MULTICAST_MAX_GROUPS];
+    uint8_t count = alles_multicast_groups(client_id, groups);
+    uint8_t still_joined = 0;
+    for(uint8_t i=0;i<joined_count;i++) {
+        if(group_in(joined_groups[i], groups, count)) {
+            joined[still_joined++] = joined_groups[i];
+        } else {
+            socket_set_ipv4_multicast_group(joined_groups[i], IP_DROP_MEMBERSHIP);
+        }
+    }
+    for(uint8_t i=0;i<count;i++) {
+        if(group_in(groups[i], joined_groups, joined_count)) continue;
+        // Not fatal, the main group still gets us everything
+        if(socket_set_ipv4_multicast_group(groups[i], IP_ADD_MEMBERSHIP) < 0) {
+            ESP_LOGW(V4TAG, "Failed to join group %08" PRIx32 ". Error %d", groups[i], errno);
+        } else {
+            joined[still_joined++] = groups[i];
+        }
+    }
+    memcpy(joined_groups, joined, sizeof(joined));
+    joined_count = still_joined;
+}
+
 void create_multicast_ipv4_socket(void) {
     struct sockaddr_in saddr = { 0 };
     sock = -1;
@@ -110,6 +158,15 @@ void create_multicast_ipv4_socket(void) {
         ESP_LOGE(V4TAG, "Failed to set IP_MULTICAST_TTL. Error %d", errno);
     }
 
+#if ALLES_DSCP
+    // Mark what we send so it goes out in the WMM voice queue rather than best effort, see ALLES_DSCP
+    int tos = ALLES_DSCP << 2;
+    err = setsockopt(sock, IPPROTO_IP, IP_TOS, &tos, sizeof(int));
+    if (err < 0) {
+        ESP_LOGE(V4TAG, "Failed to set IP_TOS. Error %d", errno);
+    }
+#endif
+
     uint8_t loopback_val = 1;
     err = setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP,
                      &loopback_val, sizeof(uint8_t));
@@ -121,39 +178,113 @@ void create_multicast_ipv4_socket(void) {
     // group for listening...
     err = socket_add_ipv4_multicast_group(true);
 
+    // Where mcast_send sends to, looked up here once rather than on every send
+    mcast_dest.sin_family = PF_INET;
+    mcast_dest.sin_port = htons(UDP_PORT);
+    inet_aton(MULTICAST_IPV4_ADDR, &mcast_dest.sin_addr.s_addr);
+    outbound_queue = xQueueCreate(OUTBOUND_QUEUE_LEN, sizeof(outbound_message_t));
+
     // All set, socket is configured for sending and receiving
 }
 
 // Send a multicast message 
-void mcast_send(char * message, uint16_t len) {
-    char addrbuf[32] = { 0 };
-    struct addrinfo hints = {
-        .ai_flags = AI_PASSIVE,
-        .ai_socktype = SOCK_DGRAM,
-    };
-    struct addrinfo *res;
+// Outbound messages go on a queue for mcast_send_task, so the listener and parse tasks never wait on sendto
+atomic_uint_fast32_t outbound_dropped = 0;
+atomic_uint_fast32_t outbound_messages = 0;
+atomic_uint_fast32_t outbound_datagrams = 0;
+
+// Send to one synth (or the host) instead of everyone, address in network order
+void mcast_send_to(uint32_t address, char * message, uint16_t len) {
+    outbound_message_t m;
+    if(len > OUTBOUND_MESSAGE_LEN) {
+        ESP_LOGE(TAG, "message too long to send: %d", len);
+        return;
+    }
+    m.address = address;
+    m.length = len;
+    memcpy(m.data, message, len);
+    if(outbound_queue == NULL || xQueueSend(outbound_queue, &m, 0) != pdTRUE) atomic_fetch_add_explicit(&outbound_dropped, 1, memory_order_relaxed);
+}
 
+void mcast_send(char * message, uint16_t len) {
+    mcast_send_to(0, message, len);
+}
 
-    hints.ai_family = AF_INET; // For an IPv4 socket
-    int err = getaddrinfo(MULTICAST_IPV4_ADDR, NULL, &hints, &res);
-    if (err < 0) {
-        ESP_LOGE(TAG, "getaddrinfo() failed for IPV4 destination address. error: %d", err);
-    }
-    if (res == 0) {
-        ESP_LOGE(TAG, "getaddrinfo() did not return any addresses");
-    }
-    ((struct sockaddr_in *)res->ai_addr)->sin_port = htons(UDP_PORT);
-    inet_ntoa_r(((struct sockaddr_in *)res->ai_addr)->sin_addr, addrbuf, sizeof(addrbuf)-1);
-    //ESP_LOGI(TAG, "Sending to IPV4 multicast address %s:%d...",  addrbuf, UDP_PORT);
-    //printf("sending message %s\n", message);
-    err = sendto(sock, message, len, 0, res->ai_addr, res->ai_addrlen);
-    freeaddrinfo(res);
+static void send_datagram(uint32_t address, char *data, uint16_t len) {
+    struct sockaddr_in daddr = mcast_dest;
+    if(address) daddr.sin_addr.s_addr = address;
+    int err = sendto(sock, data, len, 0, (struct sockaddr *)&daddr, sizeof(daddr));
     if (err < 0) {
         ESP_LOGE(TAG, "IPV4 sendto failed. errno: %d", errno);
     }
+    atomic_fetch_add_explicit(&outbound_datagrams, 1, memory_order_relaxed);
+}
+
+// Sends whatever is queued, runs of messages to the same place as one datagram.
+// They're Z delimited so they split apart again on arrival. It doesn't wait for more to join a
+// datagram, only what's already queued when it wakes goes together, so nothing is held back
+void mcast_send_task(void *pvParameters) {
+    static outbound_message_t m;
+    static char datagram[OUTBOUND_DATAGRAM_LEN];
+    while(1) {
+        xQueueReceive(outbound_queue, &m, portMAX_DELAY);
+        uint16_t length = 0;
+        uint32_t address = m.address;
+        uint8_t more = 1;
+        while(more) {
+            if(length && (m.address != address || length + m.length > OUTBOUND_DATAGRAM_LEN)) {
+                send_datagram(address, datagram, length);
+                length = 0;
+            }
+            address = m.address;
+            memcpy(datagram + length, m.data, m.length);
+            length += m.length;
+            atomic_fetch_add_explicit(&outbound_messages, 1, memory_order_relaxed);
+            more = (xQueueReceive(outbound_queue, &m, 0) == pdTRUE);
+        }
+        send_datagram(address, datagram, length);
+    }
+}
+
+
+// Called from parse_task: take the next message off the ring. Returns 0 if it's empty
+uint8_t mcast_ring_pop(message_desc_t *desc) {
+    uint_fast32_t tail = atomic_load_explicit(&message_ring_tail, memory_order_relaxed);
+    if(tail == atomic_load_explicit(&message_ring_head, memory_order_acquire)) return 0;
+    *desc = message_ring[tail & (MESSAGE_RING_LEN-1)];
+    atomic_store_explicit(&message_ring_tail, tail + 1, memory_order_release);
+    return 1;
 }
 
+// Called from parse_task once a popped message is parsed, so its packet can go back to the pool
+void mcast_ring_done(message_desc_t *desc) {
+    packet_release(desc->packet);
+    if(atomic_load_explicit(&listener_waiting, memory_order_acquire)) xTaskNotifyGive(mcastTask);
+}
 
+// Block mcast_task until the parse task has made some progress. Notifications are latched, so one
+// sent after listener_waiting is set can't be missed. But the parse task may already have freed what
+// we're waiting for before it was set, and then has nothing left to finish and notify us about, so
+// we wake up and look again after the timeout rather than sleep forever
+static void wait_for_parse_task() {
+    atomic_store_explicit(&listener_waiting, true, memory_order_release);
+    xTaskNotifyGive(parseTask);
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(10));
+    atomic_store_explicit(&listener_waiting, false, memory_order_release);
+}
+
+static void mcast_ring_push(char *message, uint16_t length, packet_t *packet) {
+    uint_fast32_t head = atomic_load_explicit(&message_ring_head, memory_order_relaxed);
+    if(head - atomic_load_explicit(&message_ring_tail, memory_order_acquire) == MESSAGE_RING_LEN) {
+        message_ring_overflow++;
+        while(head - atomic_load_explicit(&message_ring_tail, memory_order_acquire) == MESSAGE_RING_LEN) {
+            wait_for_parse_task();
+        }
+    }
+    message_ring[head & (MESSAGE_RING_LEN-1)] = (message_desc_t){ .message = message, .length = length, .packet = packet };
+    packet_retain(packet);
+    atomic_store_explicit(&message_ring_head, head + 1, memory_order_release);
+}
 
 void mcast_listen_task(void *pvParameters) {
     struct timeval tv = {
@@ -161,8 +292,10 @@ void mcast_listen_task(void *pvParameters) {
         .tv_usec = 0,
     };
     
-    ipv4_quartet = esp_ip4_addr4(&wifi_manager_ip4);
-    int16_t full_message_length;
+    // Our node ID is a hash of our MAC, so it doesn't depend on the address DHCP gave us
+    uint8_t mac[6];
+    esp_read_mac(mac, ESP_MAC_WIFI_STA);
+    node_id = alles_node_id(mac, sizeof(mac));
     printf("Network listening running on core %d\n",xPortGetCoreID());
     while (1) {
 
@@ -189,40 +322,41 @@ void mcast_listen_task(void *pvParameters) {
             }
             else if (s > 0) {
                 if (FD_ISSET(sock, &rfds)) {
+                    // As close to arrival as we get with sockets, before waiting on the pool or parsing
+                    int64_t received = amy_sysclock();
+                    // Every packet may still be being parsed, if so wait for the parse task to free one up
+                    packet_t *packet = packet_alloc();
+                    while(packet == NULL) {
+                        wait_for_parse_task();
+                        packet = packet_alloc();
+                    }
+                    packet_pool_mark();
                     // Incoming UDP packet received
                     struct sockaddr_in6 raddr; // Large enough for both IPv4 or IPv6
                     socklen_t socklen = sizeof(raddr);
-                    full_message_length = recvfrom(sock, udp_message, sizeof(udp_message)-1, 0,
+                    packet->length = recvfrom(sock, packet->data, MAX_RECEIVE_LEN-1, 0,
                                        (struct sockaddr *)&raddr, &socklen);
-                    if (full_message_length < 0) {
+                    if (packet->length < 0) {
                         ESP_LOGE(TAG, "multicast recvfrom failed: errno %d", errno);
+                        packet_release(packet);
                         err = -1;
                         break;
                     }
-                    udp_message[full_message_length] = 0;
-                    //fprintf(stderr, "###%s###\n", udp_message);
-                    uint16_t start = 0;
-                    // Break the packet up into messages (delimited by Z.)
-                    for(uint16_t i=0;i<full_message_length;i++) {
-                        if(udp_message[i] == 'Z') {
-                            udp_message[i] = 0;
-                            udp_message_counter++;
-                            message_start_pointer = udp_message + start;
-                            message_length = i - start;
-                            // tell the parse task, time to parse this message into deltas and add to the queue
-                            xTaskNotifyGive(parseTask);
-                            // And wait for it to come back
-                            ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
-                            start = i+1;
-                        }
-                    }
+                    packet->source = ((struct sockaddr_in *)&raddr)->sin_addr.s_addr;
+                    packet->port = ((struct sockaddr_in *)&raddr)->sin_port;
+                    packet->received = received;
+                    //fprintf(stderr, "###%s###\n", packet->data);
+                    // Break the packet up into messages and queue them all for the parse task
+                    // Each message is parsed in place and keeps the packet out of the pool until it's done
+                    udp_message_counter += packet_split(packet, mcast_ring_push);
+                    packet_release(packet);
+                    // One wakeup for the whole datagram, the parse task drains everything queued
+                    xTaskNotifyGive(parseTask);
                 }
             }
-            // Do a ping every so often
-            int64_t sysclock = esp_timer_get_time() / 1000;
-            if(sysclock > (last_ping_time+PING_TIME_MS)) {
-                ping(sysclock);
-            }
+            // The parse task moved our client_id, follow it to its groups. Within a select timeout is soon enough
+            if(atomic_exchange(&multicast_groups_dirty, false)) mcast_update_groups();
+            // Pings are sent from the parse task, see alles_tick
         }
 
         ESP_LOGE(TAG, "Shutting down socket and restarting...");
@@ -0,0 +1,296 @@
+// packet.c
+// A fixed pool of receive buffers shared by the multicast listener and the parser.
+// The listener fills a packet and holds one reference while it splits it into messages;
+// every message handed off to be parsed holds another, pointing into the packet in place.
+// The packet goes back to the pool when the last reference is released.
+
+#include "alles.h"
+
+static packet_t packet_pool[PACKET_POOL_LEN];
+uint32_t packet_pool_exhausted = 0;  // times a packet was wanted and none were free
+uint16_t packet_pool_high_water = 0; // most packets ever in use at once
+static atomic_uint_fast16_t packets_in_use = 0;
+
+// Called from the listener only. Returns NULL if every packet is still being parsed
+packet_t *packet_alloc() {
+    for(uint16_t i=0;i<PACKET_POOL_LEN;i++) {
+        if(atomic_load_explicit(&packet_pool[i].refs, memory_order_acquire) == 0) {
+            atomic_store_explicit(&packet_pool[i].refs, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&packets_in_use, 1, memory_order_relaxed);
+            packet_pool[i].length = 0;
+            packet_pool[i].received = -1;
+            return &packet_pool[i];
+        }
+    }
+    packet_pool_exhausted++;
+    return NULL;
+}
+
+// Called from the listener once the packets it took have datagrams in them, so packets taken for a
+// batch receive that nothing arrived in don't count towards the high water mark
+void packet_pool_mark() {
+    uint16_t in_use = atomic_load_explicit(&packets_in_use, memory_order_relaxed);
+    if(in_use > packet_pool_high_water) packet_pool_high_water = in_use;
+}
+
+void packet_retain(packet_t *packet) {
+    atomic_fetch_add_explicit(&packet->refs, 1, memory_order_relaxed);
+}
+
+// Safe to call from any task
+void packet_release(packet_t *packet) {
+    if(atomic_fetch_sub_explicit(&packet->refs, 1, memory_order_acq_rel) == 1) {
+        atomic_fetch_sub_explicit(&packets_in_use, 1, memory_order_relaxed);
+    }
+}
+
+// Senders can number their datagrams with a "#<seq>,<session>Z" header, where the session is picked at
+// random when the sender starts so a restarted sender (or a second one sharing its address and port)
+// isn't mistaken for the first. Older senders leave out ",<session>", which is session 0. We keep a
+// sliding window of the last SEQUENCE_WINDOW sequence numbers seen from each sender, so copies of a
+// datagram sent more than once (for reliability) are dropped before any of their messages are parsed.
+// Numbers that slide out of the window without ever arriving are counted as lost.
+typedef struct {
+    uint32_t source;
+    uint16_t port;
+    uint32_t session;
+    uint32_t highest;       // highest sequence number seen
+    uint64_t window;        // bit n set if highest-n has been seen
+    uint32_t received;
+    uint32_t duplicates;
+    uint32_t lost;
+    int64_t last_heard;
+} sequence_source_t;
+
+static sequence_source_t sequence_sources[MAX_SEQUENCE_SOURCES];
+uint32_t packet_duplicates = 0;
+uint32_t packet_lost = 0;
+
+static uint8_t sequence_same_source(sequence_source_t *s, packet_t *packet, uint32_t session) {
+    return s->last_heard && s->source == packet->source && s->port == packet->port && s->session == session;
+}
+
+static sequence_source_t *sequence_source(packet_t *packet, uint32_t session, int64_t sysclock) {
+    sequence_source_t *oldest = &sequence_sources[0];
+    for(uint8_t i=0;i<MAX_SEQUENCE_SOURCES;i++) {
+        if(sequence_same_source(&sequence_sources[i], packet, session)) {
+            // Quiet for too long, whatever it remembers says nothing about what's coming now
+            if(sysclock - sequence_sources[i].last_heard > SEQUENCE_EXPIRE_MS) sequence_sources[i].last_heard = 0;
+            return &sequence_sources[i];
+        }
+        if(sequence_sources[i].last_heard < oldest->last_heard) oldest = &sequence_sources[i];
+    }
+    // New sender, take over whoever we heard from longest ago
+    memset(oldest, 0, sizeof(sequence_source_t));
+    oldest->source = packet->source;
+    oldest->port = packet->port;
+    oldest->session = session;
+    return oldest;
+}
+
+// Returns 0 if we've already seen this sequence number from this sender
+static uint8_t sequence_accept(packet_t *packet, uint32_t session, uint32_t seq) {
+    int64_t sysclock = amy_sysclock();
+    sequence_source_t *s = sequence_source(packet, session, sysclock);
+    uint8_t first = (s->last_heard == 0);
+    s->last_heard = sysclock;
+    int32_t ahead = (int32_t)(seq - s->highest);
+    if(first || ahead <= -SEQUENCE_WINDOW) {
+        // First from this sender, or so far behind it must have restarted its numbering.
+        // Nothing before this one was ever expected, so don't count it as lost when it slides off
+        s->highest = seq;
+        s->window = ~0ULL;
+    } else if(ahead > 0) {
+        // Slide the window forward, anything falling off the end that never arrived is lost
+        uint32_t lost;
+        if(ahead >= SEQUENCE_WINDOW) {
+            lost = (SEQUENCE_WINDOW - __builtin_popcountll(s->window)) + (ahead - SEQUENCE_WINDOW);
+            s->window = 1;
+        } else {
+            lost = ahead - __builtin_popcountll(s->window >> (SEQUENCE_WINDOW - ahead));
+            s->window = (s->window << ahead) | 1;
+        }
+        s->lost += lost;
+        packet_lost += lost;
+        s->highest = seq;
+    } else {
+        uint64_t bit = 1ULL << (-ahead);
+        if(s->window & bit) {
+            s->duplicates++;
+            packet_duplicates++;
+            return 0;
+        }
+        s->window |= bit;
+    }
+    s->received++;
+    return 1;
+}
+
+// Have we seen this sequence number from this sender? Too old to tell counts as seen
+static uint8_t sequence_seen(packet_t *packet, uint32_t session, uint32_t seq) {
+    for(uint8_t i=0;i<MAX_SEQUENCE_SOURCES;i++) {
+        sequence_source_t *s = &sequence_sources[i];
+        if(!sequence_same_source(s, packet, session)) continue;
+        int32_t ahead = (int32_t)(seq - s->highest);
+        if(ahead > 0) return 0;
+        if(ahead <= -SEQUENCE_WINDOW) return 1;
+        return (s->window >> (-ahead)) & 1;
+    }
+    return 0;
+}
+
+// Forward error correction. A sender can follow every K numbered datagrams with a parity datagram,
+// "%<first seq>,<K>,<session>Z" then the XOR of the K datagrams' lengths (2 bytes, little-endian) and the XOR of
+// their bytes, each padded with zeros to the longest. We keep copies of the last few numbered
+// datagrams, and if exactly one of a group never arrived we rebuild it from the parity and the others.
+typedef struct {
+    uint32_t source;
+    uint16_t port;
+    uint32_t session;
+    uint32_t seq;
+    uint16_t length; // 0 if empty
+    char data[FEC_MAX_DATAGRAM];
+} fec_entry_t;
+
+static fec_entry_t fec_cache[FEC_CACHE_LEN];
+static uint8_t fec_cache_next = 0;
+uint32_t fec_recovered = 0;     // datagrams rebuilt from parity
+uint32_t fec_unrecoverable = 0; // groups missing too much to rebuild
+
+// Keep a copy of a numbered datagram (before packet_split takes it apart) in case a parity needs it
+static void fec_remember(packet_t *packet, uint32_t session, uint32_t seq) {
+    if(packet->length > FEC_MAX_DATAGRAM) return;
+    fec_entry_t *f = &fec_cache[fec_cache_next];
+    fec_cache_next = (fec_cache_next + 1) % FEC_CACHE_LEN;
+    f->source = packet->source;
+    f->port = packet->port;
+    f->session = session;
+    f->seq = seq;
+    f->length = packet->length;
+    memcpy(f->data, packet->data, packet->length);
+}
+
+static fec_entry_t *fec_find(packet_t *packet, uint32_t session, uint32_t seq) {
+    for(uint8_t i=0;i<FEC_CACHE_LEN;i++) {
+        fec_entry_t *f = &fec_cache[i];
+        if(f->length && f->source == packet->source && f->port == packet->port && f->session == session && f->seq == seq) return f;
+    }
+    return NULL;
+}
+
+// Handle a parity datagram, returns how many messages were delivered from a rebuilt datagram
+static uint16_t fec_recover(packet_t *parity, void (*deliver)(char *message, uint16_t length, packet_t *packet)) {
+    char *data = parity->data;
+    char *end = memchr(data, 'Z', parity->length);
+    if(end == NULL) return 0;
+    char *p;
+    uint32_t first = strtoul(data + 1, &p, 10);
+    if(*p != ',') return 0;
+    uint32_t k = strtoul(p + 1, &p, 10);
+    uint32_t session = (*p == ',') ? strtoul(p + 1, NULL, 10) : 0;
+    uint8_t *payload = (uint8_t*)end + 1;
+    int16_t payload_length = parity->length - (payload - (uint8_t*)data) - 2;
+    if(k == 0 || k > FEC_CACHE_LEN || payload_length < 0) return 0;
+
+    uint32_t missing_seq = 0;
+    uint8_t missing = 0;
+    for(uint32_t i=0;i<k;i++) {
+        if(!sequence_seen(parity, session, first + i)) { missing++; missing_seq = first + i; }
+    }
+    if(missing == 0) return 0; // got them all, nothing to do
+    if(missing > 1) { fec_unrecoverable++; return 0; }
+
+    uint16_t length = payload[0] | (payload[1] << 8);
+    for(uint32_t i=0;i<k;i++) {
+        if(first + i == missing_seq) continue;
+        fec_entry_t *f = fec_find(parity, session, first + i);
+        if(f == NULL) { fec_unrecoverable++; return 0; } // seen but not kept, can't help
+        length ^= f->length;
+    }
+    packet_t *rebuilt = packet_alloc();
+    if(length > payload_length || length >= MAX_RECEIVE_LEN || rebuilt == NULL) {
+        if(rebuilt) packet_release(rebuilt);
+        fec_unrecoverable++;
+        return 0;
+    }
+    packet_pool_mark();
+    memcpy(rebuilt->data, payload + 2, length);
+    for(uint32_t i=0;i<k;i++) {
+        if(first + i == missing_seq) continue;
+        fec_entry_t *f = fec_find(parity, session, first + i);
+        for(uint16_t j=0;j<length && j<f->length;j++) rebuilt->data[j] ^= f->data[j];
+    }
+    rebuilt->length = length;
+    rebuilt->source = parity->source;
+    rebuilt->port = parity->port;
+    fec_recovered++;
+    // The rebuilt datagram has its own sequence header, so it's counted as seen and never parsed twice
+    uint16_t messages = packet_split(rebuilt, deliver);
+    packet_release(rebuilt);
+    return messages;
+}
+
+void packet_show_stats() {
+    printf("packet pool: %d buffers, %d in use, high water %d, exhausted %" PRIu32 " times\n",
+        PACKET_POOL_LEN, (int)atomic_load(&packets_in_use), packet_pool_high_water, packet_pool_exhausted);
+    for(uint8_t i=0;i<MAX_SEQUENCE_SOURCES;i++) {
+        sequence_source_t *s = &sequence_sources[i];
+        if(!s->last_heard) continue;
+        uint8_t *ip = (uint8_t*)&s->source;
+        uint8_t *port = (uint8_t*)&s->port;
+        printf("sender %d.%d.%d.%d:%d session %" PRIu32 ": %" PRIu32 " datagrams, %" PRIu32 " duplicates dropped, %" PRIu32 " lost\n",
+            ip[0], ip[1], ip[2], ip[3], (port[0] << 8) | port[1], s->session, s->received, s->duplicates, s->lost);
+    }
+    printf("fec: %" PRIu32 " datagrams rebuilt, %" PRIu32 " groups unrecoverable\n", fec_recovered, fec_unrecoverable);
+}
+
+// Break a packet up into messages and hand each one to deliver, in place. ASCII messages are delimited
+// by Z (which is replaced with a 0), binary ones (see wire.h) carry their own length. Returns how many,
+// which is none if the packet has a sequence header we've already seen. A parity packet delivers the
+// messages of the datagram it rebuilds, if any
+uint16_t packet_split(packet_t *packet, void (*deliver)(char *message, uint16_t length, packet_t *packet)) {
+    char *data = packet->data;
+    uint16_t messages = 0;
+    uint16_t start = 0;
+    data[packet->length] = 0;
+    packet->to_me = 0;
+    // Unicast header, "@<node>Z". If it's our node ID, everything in it is ours whatever client it names
+    if(data[0] == '@') {
+        char *end = memchr(data, 'Z', packet->length);
+        if(end == NULL) return 0;
+        packet->to_me = (strtoul(data + 1, NULL, 10) == node_id);
+        start = (end - data) + 1;
+    }
+    // Sequence number header, drop the whole datagram if it's a copy of one we've had
+    if(data[start] == '#') {
+        char *end = memchr(data + start, 'Z', packet->length - start);
+        if(end == NULL) return 0;
+        char *p;
+        uint32_t seq = strtoul(data + start + 1, &p, 10);
+        uint32_t session = (*p == ',') ? strtoul(p + 1, NULL, 10) : 0;
+        if(!sequence_accept(packet, session, seq)) return 0;
+        fec_remember(packet, session, seq);
+        start = (end - data) + 1;
+    }
+    // Parity for a group of numbered datagrams
+    if(data[0] == '%') return fec_recover(packet, deliver);
+    while(start < packet->length) {
+        if((uint8_t)data[start] == ALLES_BINARY_MAGIC) {
+            if(start + 2 > packet->length) break;
+            uint16_t frame_length = 2 + (uint8_t)data[start+1];
+            if(start + frame_length > packet->length) break; // truncated, drop it
+            deliver(data + start, frame_length, packet);
+            messages++;
+            start += frame_length;
+        } else {
+            uint16_t i = start;
+            while(i < packet->length && data[i] != 'Z') i++;
+            if(i == packet->length) break; // no Z, not a complete message
+            data[i] = 0;
+            deliver(data + start, i - start, packet);
+            messages++;
+            start = i + 1;
+        }
+    }
+    return messages;
+}
@@ -0,0 +1,74 @@
+// wire.h
+// Alles compact binary message format, an alternative to the ASCII one for high event rates.
+//
+// A binary message is [ALLES_BINARY_MAGIC][body length][body], with no Z delimiter. The body is
+// a run of fields, each a one byte tag followed by a fixed width little-endian value. Tags are the
+// same letters as the ASCII protocol, so "v0w4f440.0l0.9Z" becomes v<i16 0> w<i16 4> f<f32 440> l<f32 0.9>.
+// Binary and ASCII messages can be mixed in one datagram.
+//
+// This is everything about the protocol that doesn't depend on AMY or the platform, so hosts can
+// build against it too (see liballes).
+#ifndef __WIRE_H
+#define __WIRE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define UDP_PORT 9294        // port to listen on
+#define MULTICAST_IPV4_ADDR "232.10.11.12"
+#define MULTICAST_CLIENT_BASE 0xE80B0000 // 232.11.x.y, the synth with client_id x*256+y listens here as well
+#define MULTICAST_GROUP_BASE 0xE80C0000  // 232.12.0.d, synths with client_id % d == 0 listen here as well
+#define MULTICAST_GROUP_MAX_DIVISOR 6    // lwIP joins 8 groups at most, and one is all-hosts
+#define ALLES_WIDE_CLIENT 65536 // client values from here address client_id (client - ALLES_WIDE_CLIENT)
+// DSCP everything is sent with. WiFi puts it in a WMM access category from its top three bits: 46 (EF) is
+// AC_VO, 34 (AF41) is AC_VI. 0, the default, leaves it unmarked and best effort like everyone else's traffic,
+// as a shared network may not want a mesh of synths in its voice queue. Build with -DALLES_DSCP=46 to mark
+#ifndef ALLES_DSCP
+#define ALLES_DSCP 0
+#endif
+
+#define ALLES_BINARY_MAGIC 0xA1  // can't start an ASCII message
+#define WIRE_MAX_BODY 255
+
+enum { WIRE_NONE = 0, WIRE_I16, WIRE_I32, WIRE_F32, WIRE_I64 };
+
+static const uint8_t wire_kinds[128] = {
+    ['v'] = WIRE_I16, // osc
+    ['w'] = WIRE_I16, // wave
+    ['p'] = WIRE_I16, // patch
+    ['n'] = WIRE_I16, // midi_note
+    ['o'] = WIRE_I16, // algorithm
+    ['G'] = WIRE_I16, // filter_type
+    ['L'] = WIRE_I16, // mod_source
+    ['g'] = WIRE_I16, // mod_target
+    ['i'] = WIRE_I16, // sync index
+    ['m'] = WIRE_I16, // target miss permille (sync only)
+    ['M'] = WIRE_I16, // mesh latency ms (sync only)
+    ['c'] = WIRE_I32, // client
+    ['r'] = WIRE_I32, // ipv4
+    ['a'] = WIRE_F32, // amp
+    ['b'] = WIRE_F32, // feedback
+    ['d'] = WIRE_F32, // duty
+    ['f'] = WIRE_F32, // freq
+    ['F'] = WIRE_F32, // filter_freq
+    ['I'] = WIRE_F32, // ratio
+    ['l'] = WIRE_F32, // velocity
+    ['P'] = WIRE_F32, // phase
+    ['Q'] = WIRE_F32, // pan
+    ['R'] = WIRE_F32, // resonance
+    ['V'] = WIRE_F32, // volume
+    ['t'] = WIRE_I64, // time
+    ['s'] = WIRE_I64, // sync
+};
+
+static const uint8_t wire_widths[] = { 0, 2, 4, 4, 8 };
+
+static inline uint8_t wire_kind(uint8_t tag) { return (tag < 128) ? wire_kinds[tag] : WIRE_NONE; }
+
+// Values are little-endian on the wire, as on the ESP32 and every desktop we build for, so these are copies
+static inline int16_t wire_get_i16(const uint8_t *p) { int16_t v; memcpy(&v, p, 2); return v; }
+static inline int32_t wire_get_i32(const uint8_t *p) { int32_t v; memcpy(&v, p, 4); return v; }
+static inline float wire_get_f32(const uint8_t *p) { float v; memcpy(&v, p, 4); return v; }
+static inline int64_t wire_get_i64(const uint8_t *p) { int64_t v; memcpy(&v, p, 8); return v; }
+
+#endif